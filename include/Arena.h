@@ -0,0 +1,143 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator for objects that share one lifetime. Allocation is a pointer increment into
+// large blocks, objects made one after another sit next to each other in memory, and
+// everything is destroyed and freed together when the arena is reset or goes away.
+class Arena
+{
+public:
+	explicit Arena(size_t blockSize = 1 << 20) : blockSize(blockSize) {}
+	~Arena() { release(); }
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+	// uninitialized storage for count trivially destructible values
+	template <typename T>
+	T* allocateArray(size_t count);
+	// constructs a T in the arena, its destructor runs when the arena is reset or destroyed
+	template <typename T, typename... Args>
+	T* create(Args&&... args);
+	// like create, wrapped for the shared_ptr based scene interfaces. The pointer does not own
+	// or count references, the arena must outlive every copy of it.
+	template <typename T, typename... Args>
+	std::shared_ptr<T> make(Args&&... args);
+
+	// destroys everything and rewinds, keeping the first block for reuse
+	void reset();
+	size_t bytesUsed() const { return used; }
+
+private:
+	struct Block
+	{
+		char* data;
+		size_t size;
+	};
+	// prepended to every object with a non-trivial destructor, newest first
+	struct Destructor
+	{
+		Destructor* next;
+		void (*destroy)(void*);
+		void* object;
+	};
+
+	void release();
+
+	size_t blockSize;
+	std::vector<Block> blocks;
+	char* cursor = nullptr;
+	char* limit = nullptr;
+	size_t used = 0;
+	Destructor* destructors = nullptr;
+};
+
+inline void* Arena::allocate(size_t size, size_t alignment)
+{
+	auto aligned = [alignment](char* p)
+	{
+		return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~(uintptr_t(alignment) - 1));
+	};
+	used += size;
+	const size_t needed = size + alignment;
+	if (needed > blockSize / 4)
+	{
+		// oversized requests get a block of their own so they don't waste the rest of a shared one
+		char* data = static_cast<char*>(::operator new(needed));
+		blocks.push_back({ data, needed });
+		return aligned(data);
+	}
+	char* p = cursor ? aligned(cursor) : nullptr;
+	if (!p || p + size > limit)
+	{
+		char* data = static_cast<char*>(::operator new(blockSize));
+		blocks.push_back({ data, blockSize });
+		limit = data + blockSize;
+		p = aligned(data);
+	}
+	cursor = p + size;
+	return p;
+}
+
+template <typename T>
+T* Arena::allocateArray(size_t count)
+{
+	static_assert(std::is_trivially_destructible<T>::value, "arena arrays are never destroyed");
+	return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+}
+
+template <typename T, typename... Args>
+T* Arena::create(Args&&... args)
+{
+	void* storage = allocate(sizeof(T), alignof(T));
+	T* object = new (storage) T(std::forward<Args>(args)...);
+	if (!std::is_trivially_destructible<T>::value)
+	{
+		auto* d = static_cast<Destructor*>(allocate(sizeof(Destructor), alignof(Destructor)));
+		*d = { destructors, [](void* p) { static_cast<T*>(p)->~T(); }, object };
+		destructors = d;
+	}
+	return object;
+}
+
+template <typename T, typename... Args>
+std::shared_ptr<T> Arena::make(Args&&... args)
+{
+	// aliasing an empty owner gives a pointer without a control block, copies don't touch a refcount
+	return std::shared_ptr<T>(std::shared_ptr<void>(), create<T>(std::forward<Args>(args)...));
+}
+
+inline void Arena::reset()
+{
+	for (Destructor* d = destructors; d; d = d->next) d->destroy(d->object);
+	destructors = nullptr;
+	Block keep = { nullptr, 0 };
+	for (const Block& b : blocks)
+	{
+		if (!keep.data && b.size == blockSize) keep = b;
+		else ::operator delete(b.data);
+	}
+	blocks.clear();
+	if (keep.data) blocks.push_back(keep);
+	cursor = keep.data;
+	limit = keep.data ? keep.data + keep.size : nullptr;
+	used = 0;
+}
+
+inline void Arena::release()
+{
+	reset();
+	for (const Block& b : blocks) ::operator delete(b.data);
+	blocks.clear();
+	cursor = limit = nullptr;
+}
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef CHUNKEDGEOMETRY_H_
+#define CHUNKEDGEOMETRY_H_
+
+#include "MeshFile.h"
+#include "Json.h"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Geometry too large to keep in memory, split into spatially coherent chunks that are each
+// a .rtmesh file with its own BVH (tools/meshchunks writes them). Only the chunk bounds are
+// held permanently; a chunk is mapped when a ray first reaches its bounds and unmapped again,
+// picked by the clock approximation of least recently used, once the resident chunks exceed the
+// byte budget. Rays reach resident chunks without locking: every chunk has an atomic mesh
+// pointer and a count of rays inside it, and eviction clears the pointer and waits for the
+// count to drain. Only page-ins and evictions take the lock. A chunk that fails to load is
+// marked and skipped from then on.
+class ChunkedGeometry : public hittable
+{
+public:
+	struct Chunk
+	{
+		std::string file;
+		aabb bounds;
+		uint64_t bytes;
+	};
+	struct Stats
+	{
+		uint64_t pageIns = 0;
+		uint64_t evictions = 0;
+		uint64_t residentBytes = 0;
+	};
+
+	ChunkedGeometry(std::vector<Chunk> chunks, shared_ptr<material> mat, uint64_t budgetBytes);
+	// reads a manifest written by meshchunks, chunk files are relative to it. nullptr on error.
+	static shared_ptr<ChunkedGeometry> load(const char* manifest, shared_ptr<material> mat, uint64_t budgetBytes);
+
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+
+	// closest hits for a batch of rays. Rays are queued on every chunk they reach and the
+	// queues are drained one chunk at a time, resident chunks first, so each chunk is paged
+	// in at most once per batch however the rays are ordered. The renderer traces one path at
+	// a time through hit(), so only callers that hold many rays at once, like the meshchunks
+	// benchmark, get the batching.
+	void hitBatch(const ray* rays, size_t count, real t_min, real t_max, hit_record* recs, bool* hits) const;
+
+	size_t chunkCount() const { return chunks.size(); }
+	Stats stats() const;
+private:
+	static constexpr uint32_t leafSize = 1;
+
+	// a chunk's mesh held for one ray, eviction waits until it is released
+	class Use
+	{
+	public:
+		Use(const ChunkedGeometry& geometry, uint32_t chunk);
+		~Use() { if (readers) readers->fetch_sub(1, std::memory_order_release); }
+		Use(const Use&) = delete;
+		Use& operator=(const Use&) = delete;
+		const TriangleMesh* operator->() const { return mesh; }
+		explicit operator bool() const { return mesh != nullptr; }
+	private:
+		const TriangleMesh* mesh = nullptr;
+		std::atomic<uint32_t>* readers = nullptr;
+	};
+	// the chunk's mesh with a reader counted, nullptr without one if the chunk is missing
+	const TriangleMesh* enter(uint32_t chunk) const;
+	// pages the chunk in under the lock, evicting others to stay within budget
+	void pageIn(uint32_t chunk) const;
+	bool resident(uint32_t chunk) const { return slots[chunk].mesh.load(std::memory_order_acquire) != nullptr; }
+
+	std::vector<Chunk> chunks;
+	std::vector<FlatBVHNode> nodes;
+	shared_ptr<material> pMat;
+	uint64_t budget;
+	aabb box;
+
+	struct Slot
+	{
+		std::atomic<TriangleMesh*> mesh{ nullptr };
+		std::atomic<uint32_t> readers{ 0 };
+		std::atomic<bool> referenced{ false };	// used since the clock hand last passed
+		std::atomic<bool> failed{ false };
+		shared_ptr<TriangleMesh> owner;			// under the lock
+	};
+	mutable std::mutex residency;			// page-ins, evictions, counters
+	mutable std::unique_ptr<Slot[]> slots;
+	mutable uint32_t hand = 0;
+	mutable Stats counters;
+};
+
+inline ChunkedGeometry::ChunkedGeometry(std::vector<Chunk> chunkList, shared_ptr<material> mat, uint64_t budgetBytes)
+	: pMat(std::move(mat)), budget(budgetBytes)
+{
+	std::vector<aabb> bounds;
+	for (const Chunk& c : chunkList) bounds.push_back(c.bounds);
+	FlatBVH bvh;
+	bvh.build(std::move(bounds), leafSize);
+	nodes = bvh.nodes();
+	box = bvh.bounds();
+	// chunks in leaf order, so a leaf names its chunks by slot
+	for (uint32_t slot : bvh.order()) chunks.push_back(std::move(chunkList[slot]));
+	slots.reset(new Slot[chunks.size()]);
+}
+
+inline shared_ptr<ChunkedGeometry> ChunkedGeometry::load(const char* manifest, shared_ptr<material> mat, uint64_t budgetBytes)
+{
+	std::ifstream in(manifest, std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "ERROR: Could not open chunk manifest '" << manifest << "'.\n";
+		return nullptr;
+	}
+	std::stringstream buffer;
+	buffer << in.rdbuf();
+	json::Value root;
+	std::string error;
+	const json::Value* list = nullptr;
+	if (!json::parse(buffer.str(), root, error) || !(list = root.find("chunks")) || !list->isArray())
+	{
+		std::cerr << "ERROR: Chunk manifest '" << manifest << "' is invalid. " << error << "\n";
+		return nullptr;
+	}
+
+	const std::string path(manifest);
+	const size_t slash = path.find_last_of("/\\");
+	const std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+	auto readVec3 = [](const json::Value* a)
+	{
+		glm::vec3 v(0.f);
+		for (int i = 0; a && a->isArray() && i < 3 && i < static_cast<int>(a->array.size()); i++)
+			v[i] = static_cast<float>(a->array[i].number);
+		return v;
+	};
+	std::vector<Chunk> chunks;
+	for (const json::Value& c : list->array)
+	{
+		const json::Value* file = c.find("file");
+		const json::Value* bytes = c.find("bytes");
+		if (!file || !file->isString() || !bytes || !bytes->isNumber())
+		{
+			std::cerr << "ERROR: Chunk manifest '" << manifest << "' has an entry without file or size.\n";
+			return nullptr;
+		}
+		chunks.push_back({ directory + file->string, aabb(readVec3(c.find("min")), readVec3(c.find("max"))),
+			static_cast<uint64_t>(bytes->number) });
+	}
+	if (chunks.empty()) return nullptr;
+	return make_shared<ChunkedGeometry>(std::move(chunks), std::move(mat), budgetBytes);
+}
+
+inline const TriangleMesh* ChunkedGeometry::enter(uint32_t chunk) const
+{
+	Slot& slot = slots[chunk];
+	while (!slot.failed.load(std::memory_order_relaxed))
+	{
+		// counted before the pointer is read, so eviction either sees the reader or we see null
+		slot.readers.fetch_add(1, std::memory_order_seq_cst);
+		const TriangleMesh* mesh = slot.mesh.load(std::memory_order_seq_cst);
+		if (mesh)
+		{
+			if (!slot.referenced.load(std::memory_order_relaxed)) slot.referenced.store(true, std::memory_order_relaxed);
+			return mesh;
+		}
+		slot.readers.fetch_sub(1, std::memory_order_release);
+		pageIn(chunk);
+	}
+	return nullptr;
+}
+
+inline ChunkedGeometry::Use::Use(const ChunkedGeometry& geometry, uint32_t chunk)
+	: mesh(geometry.enter(chunk))
+{
+	if (mesh) readers = &geometry.slots[chunk].readers;
+}
+
+inline void ChunkedGeometry::pageIn(uint32_t chunk) const
+{
+	std::lock_guard<std::mutex> lock(residency);
+	Slot& slot = slots[chunk];
+	if (slot.owner || slot.failed.load(std::memory_order_relaxed)) return;	// another thread got here first
+
+	shared_ptr<TriangleMesh> mesh = meshfile::load(chunks[chunk].file.c_str(), pMat);
+	if (!mesh)
+	{
+		// reported once by the loader, later rays skip the chunk
+		slot.failed.store(true, std::memory_order_relaxed);
+		return;
+	}
+	counters.pageIns++;
+	counters.residentBytes += chunks[chunk].bytes;
+	// the chunk being loaded stays even if it alone is over budget
+	const uint32_t count = static_cast<uint32_t>(chunks.size());
+	for (uint32_t scanned = 0; counters.residentBytes > budget && scanned < 2 * count; scanned++)
+	{
+		const uint32_t victim = hand;
+		hand = (hand + 1) % count;
+		Slot& v = slots[victim];
+		if (!v.owner || v.referenced.exchange(false, std::memory_order_relaxed)) continue;
+		v.mesh.store(nullptr, std::memory_order_seq_cst);
+		// rays already inside the chunk finish their mesh hit first
+		while (v.readers.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+		v.owner.reset();
+		counters.residentBytes -= chunks[victim].bytes;
+		counters.evictions++;
+	}
+	slot.owner = std::move(mesh);
+	slot.referenced.store(true, std::memory_order_relaxed);
+	slot.mesh.store(slot.owner.get(), std::memory_order_seq_cst);
+}
+
+inline ChunkedGeometry::Stats ChunkedGeometry::stats() const
+{
+	std::lock_guard<std::mutex> lock(residency);
+	return counters;
+}
+
+inline bool ChunkedGeometry::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	// nearest chunks are visited first, so chunks behind the closest hit are never paged in
+	return FlatBVH::traverse(nodes.data(), r, static_cast<float>(t_min), static_cast<float>(t_max), [&](uint32_t first, uint32_t n, float& tMax)
+	{
+		bool hitLeaf = false;
+		for (uint32_t c = first; c < first + n; ++c)
+		{
+			const Use mesh(*this, c);
+			if (mesh && mesh->hit(r, t_min, tMax, rec))
+			{
+				hitLeaf = true;
+				tMax = static_cast<float>(rec.t);
+			}
+		}
+		return hitLeaf;
+	});
+}
+
+inline bool ChunkedGeometry::boundingBox(float t0, float t1, aabb& outBox) const
+{
+	outBox = box;
+	return true;
+}
+
+inline void ChunkedGeometry::hitBatch(const ray* rays, size_t count, real t_min, real t_max, hit_record* recs, bool* hits) const
+{
+	struct Queued
+	{
+		uint32_t ray;
+		float tEnter;
+	};
+	std::vector<std::vector<Queued>> queues(chunks.size());
+	std::vector<float> closest(count, static_cast<float>(t_max));
+	for (size_t i = 0; i < count; i++)
+	{
+		hits[i] = false;
+		FlatBVH::traverse(nodes.data(), rays[i], static_cast<float>(t_min), static_cast<float>(t_max), [&](uint32_t first, uint32_t n, float&)
+		{
+			for (uint32_t c = first; c < first + n; ++c)
+			{
+				float tEnter, tExit;
+				int enterAxis, exitAxis;
+				Box::slab(chunks[c].bounds.min(), chunks[c].bounds.max(), rays[i], tEnter, tExit, enterAxis, exitAxis);
+				queues[c].push_back({ static_cast<uint32_t>(i), tEnter });
+			}
+			return false;	// keep going, every chunk on the ray gets the ray queued
+		});
+	}
+
+	std::vector<uint32_t> schedule;
+	for (uint32_t c = 0; c < chunks.size(); c++)
+		if (!queues[c].empty()) schedule.push_back(c);
+	std::vector<char> isResident(chunks.size());
+	for (uint32_t c : schedule) isResident[c] = resident(c);
+	std::stable_sort(schedule.begin(), schedule.end(), [&](uint32_t a, uint32_t b)
+	{
+		if (isResident[a] != isResident[b]) return isResident[a] > isResident[b];
+		return queues[a].size() > queues[b].size();
+	});
+
+	for (uint32_t c : schedule)
+	{
+		// a ray whose closest hit so far is in front of the chunk doesn't need it any more
+		bool needed = false;
+		for (const Queued& q : queues[c]) needed |= q.tEnter <= closest[q.ray];
+		if (!needed) continue;
+		const Use mesh(*this, c);
+		if (!mesh) continue;
+		for (const Queued& q : queues[c])
+		{
+			if (q.tEnter > closest[q.ray]) continue;
+			if (mesh->hit(rays[q.ray], t_min, closest[q.ray], recs[q.ray]))
+			{
+				hits[q.ray] = true;
+				closest[q.ray] = static_cast<float>(recs[q.ray].t);
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef COMPILEDSCENE_H_
+#define COMPILEDSCENE_H_
+
+#include "hittable.h"
+#include "flatbvh.h"
+#include "Instance.h"
+#include "MaterialTable.h"
+
+// Render-time form of a scene. Containers are flattened away, built-in primitives are
+// lowered into per-type arrays and one BVH over everything dispatches leaves with a switch,
+// so the primitive tests inline into traversal. Transform chains are folded into single
+// Instances first. Objects without a plain form (media, instances, sphere sets, meshes)
+// are kept and called through hittable::hit. The materials of the lowered primitives go into
+// a MaterialTable and hits on them carry their record's index.
+class CompiledScene : public hittable
+{
+public:
+	CompiledScene(const hittable_list& list, float time0, float time1);
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+	void collectLights(vector<LightPrim>& out) const override { source.collectLights(out); }
+	const MaterialTable* materials() const override { return &materialTable; }
+	size_t primitiveCount() const { return prims.size(); }
+private:
+	static constexpr uint32_t leafSize = 4;
+
+	// primitive type in the top four bits, index into the array of that type below
+	struct PrimitiveRef
+	{
+		uint32_t bits;
+		PrimitiveType type() const { return static_cast<PrimitiveType>(bits >> 28); }
+		uint32_t index() const { return bits & 0x0fffffffu; }
+	};
+	static PrimitiveRef makeRef(PrimitiveType type, size_t index)
+	{
+		return { static_cast<uint32_t>(type) << 28 | static_cast<uint32_t>(index) };
+	}
+
+	// the primitive tests only find t, attributes are filled in once for the closest hit
+	bool hitPrimitive(PrimitiveRef ref, const ray& r, float tMin, float tMax, float& t, hit_record& rec) const;
+	void finalize(PrimitiveRef ref, const ray& r, float t, hit_record& rec) const;
+	static bool hitSphere(const glm::vec3& center, float radius, const ray& r, float tMin, float tMax, float& t);
+	static glm::vec3 movingCenter(const MovingSpherePrim& s, float time);
+	template <int A, int B, int K>
+	static bool hitRect(const RectPrim& q, const ray& r, float tMin, float tMax, float& t);
+	template <int A, int B, int K>
+	static void finalizeRect(const RectPrim& q, const ray& r, float t, hit_record& rec);
+	static void finalizeSphere(const glm::vec3& center, float radius, const material* pMat, const ray& r, float t, hit_record& rec);
+
+	hittable_list source;						// owns the objects and materials the arrays point at
+	PrimitiveStore store;
+	vector<shared_ptr<hittable>> generics;
+	vector<shared_ptr<hittable>> unbounded;		// objects without a bounding box, tested outside the BVH
+	vector<PrimitiveRef> prims;					// in BVH leaf order
+	vector<uint32_t> primMaterials;				// per prim, the record in materialTable
+	vector<FlatBVHNode> nodes;
+	MaterialTable materialTable;
+};
+
+inline CompiledScene::CompiledScene(const hittable_list& list, float time0, float time1) : source(list)
+{
+	PrimitiveStore lowered;
+	vector<PrimitiveRef> refs;
+	vector<aabb> bounds;
+	vector<shared_ptr<hittable>> pending = list.getObjects();
+	while (!pending.empty())
+	{
+		auto obj = pending.back();
+		pending.pop_back();
+		if (obj->flatten(pending)) continue;
+		obj = Instance::fold(obj);
+
+		aabb objBox;
+		if (!obj->boundingBox(time0, time1, objBox))
+		{
+			unbounded.push_back(obj);
+			continue;
+		}
+		const PrimitiveType type = obj->lower(lowered);
+		size_t index = 0;
+		switch (type)
+		{
+		case PrimitiveType::Sphere: index = lowered.spheres.size() - 1; break;
+		case PrimitiveType::MovingSphere: index = lowered.movingSpheres.size() - 1; break;
+		case PrimitiveType::XYRect:
+		case PrimitiveType::YZRect:
+		case PrimitiveType::XZRect: index = lowered.rects.size() - 1; break;
+		case PrimitiveType::Box: index = lowered.boxes.size() - 1; break;
+		case PrimitiveType::Generic:
+			index = generics.size();
+			generics.push_back(obj);
+			break;
+		}
+		refs.push_back(makeRef(type, index));
+		bounds.push_back(objBox);
+	}
+
+	FlatBVH bvh;
+	bvh.build(std::move(bounds), leafSize);
+	nodes = bvh.nodes();
+
+	// copy the primitives in leaf order so traversal walks the arrays front to back
+	prims.reserve(refs.size());
+	primMaterials.reserve(refs.size());
+	for (uint32_t slot : bvh.order())
+	{
+		const PrimitiveRef ref = refs[slot];
+		const material* pMat = nullptr;
+		switch (ref.type())
+		{
+		case PrimitiveType::Sphere:
+			prims.push_back(makeRef(ref.type(), store.spheres.size()));
+			store.spheres.push_back(lowered.spheres[ref.index()]);
+			pMat = store.spheres.back().pMat;
+			break;
+		case PrimitiveType::MovingSphere:
+			prims.push_back(makeRef(ref.type(), store.movingSpheres.size()));
+			store.movingSpheres.push_back(lowered.movingSpheres[ref.index()]);
+			pMat = store.movingSpheres.back().pMat;
+			break;
+		case PrimitiveType::XYRect:
+		case PrimitiveType::YZRect:
+		case PrimitiveType::XZRect:
+			prims.push_back(makeRef(ref.type(), store.rects.size()));
+			store.rects.push_back(lowered.rects[ref.index()]);
+			pMat = store.rects.back().pMat;
+			break;
+		case PrimitiveType::Box:
+			prims.push_back(makeRef(ref.type(), store.boxes.size()));
+			store.boxes.push_back(lowered.boxes[ref.index()]);
+			pMat = store.boxes.back().pMat;
+			break;
+		case PrimitiveType::Generic:
+			prims.push_back(ref);
+			break;
+		}
+		primMaterials.push_back(pMat ? materialTable.add(pMat) : MaterialTable::none);
+	}
+}
+
+inline bool CompiledScene::hitSphere(const glm::vec3& center, float radius, const ray& r, float tMin, float tMax, float& t)
+{
+	real root;
+	if (!sphere::intersect(center, radius, r, tMin, tMax, root)) return false;
+	t = static_cast<float>(root);
+	return true;
+}
+
+inline glm::vec3 CompiledScene::movingCenter(const MovingSpherePrim& s, float time)
+{
+	return s.center0 + ((time - s.time0) / (s.time1 - s.time0)) * (s.center1 - s.center0);
+}
+
+template <int A, int B, int K>
+inline bool CompiledScene::hitRect(const RectPrim& q, const ray& r, float tMin, float tMax, float& t)
+{
+	const float tk = (q.k - r.origin()[K]) / r.direction()[K];
+	if (tk < tMin || tk > tMax) return false;
+	const float a = r.origin()[A] + tk * r.direction()[A];
+	const float b = r.origin()[B] + tk * r.direction()[B];
+	if (a < q.a0 || a > q.a1 || b < q.b0 || b > q.b1) return false;
+	t = tk;
+	return true;
+}
+
+template <int A, int B, int K>
+inline void CompiledScene::finalizeRect(const RectPrim& q, const ray& r, float t, hit_record& rec)
+{
+	rec.t = t;
+	rec.p = r.at(t);
+	glm::vec3 outward_normal(0.f);
+	outward_normal[K] = 1.f;
+	rec.set_face_normal(r, outward_normal);
+	rec.u = (rec.p[A] - q.a0) / (q.a1 - q.a0);
+	rec.v = (rec.p[B] - q.b0) / (q.b1 - q.b0);
+	rec.uvScale = 1.f / std::sqrt((q.a1 - q.a0) * (q.b1 - q.b0));
+	rec.pMat = q.pMat;
+}
+
+inline void CompiledScene::finalizeSphere(const glm::vec3& center, float radius, const material* pMat, const ray& r, float t, hit_record& rec)
+{
+	rec.t = t;
+	rec.p = r.at(t);
+	const glm::vec3 outward_normal = (rec.p - center) / radius;
+	rec.set_face_normal(r, outward_normal);
+	sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+	rec.uvScale = sphere::uv_scale(radius, outward_normal);
+	rec.pMat = pMat;
+}
+
+inline bool CompiledScene::hitPrimitive(PrimitiveRef ref, const ray& r, float tMin, float tMax, float& t, hit_record& rec) const
+{
+	switch (ref.type())
+	{
+	case PrimitiveType::Sphere:
+	{
+		const SpherePrim& s = store.spheres[ref.index()];
+		return hitSphere(s.center, s.radius, r, tMin, tMax, t);
+	}
+	case PrimitiveType::MovingSphere:
+	{
+		const MovingSpherePrim& s = store.movingSpheres[ref.index()];
+		return hitSphere(movingCenter(s, r.time()), s.radius, r, tMin, tMax, t);
+	}
+	case PrimitiveType::XYRect: return hitRect<0, 1, 2>(store.rects[ref.index()], r, tMin, tMax, t);
+	case PrimitiveType::YZRect: return hitRect<1, 2, 0>(store.rects[ref.index()], r, tMin, tMax, t);
+	case PrimitiveType::XZRect: return hitRect<0, 2, 1>(store.rects[ref.index()], r, tMin, tMax, t);
+	case PrimitiveType::Box:
+	{
+		const BoxPrim& b = store.boxes[ref.index()];
+		float tEnter, tExit;
+		int enterAxis, exitAxis;
+		if (!Box::slab(b.boxMin, b.boxMax, r, tEnter, tExit, enterAxis, exitAxis)) return false;
+		const float tHit = tEnter < tMin ? tExit : tEnter;
+		if (tHit < tMin || tHit > tMax) return false;
+		t = tHit;
+		return true;
+	}
+	case PrimitiveType::Generic:
+		// opaque objects fill in the whole record themselves, their materials are not in the table
+		if (!generics[ref.index()]->hit(r, tMin, tMax, rec)) return false;
+		rec.materialId = hit_record::noMaterial;
+		t = static_cast<float>(rec.t);
+		return true;
+	}
+	return false;
+}
+
+inline void CompiledScene::finalize(PrimitiveRef ref, const ray& r, float t, hit_record& rec) const
+{
+	switch (ref.type())
+	{
+	case PrimitiveType::Sphere:
+	{
+		const SpherePrim& s = store.spheres[ref.index()];
+		return finalizeSphere(s.center, s.radius, s.pMat, r, t, rec);
+	}
+	case PrimitiveType::MovingSphere:
+	{
+		const MovingSpherePrim& s = store.movingSpheres[ref.index()];
+		return finalizeSphere(movingCenter(s, r.time()), s.radius, s.pMat, r, t, rec);
+	}
+	case PrimitiveType::XYRect: return finalizeRect<0, 1, 2>(store.rects[ref.index()], r, t, rec);
+	case PrimitiveType::YZRect: return finalizeRect<1, 2, 0>(store.rects[ref.index()], r, t, rec);
+	case PrimitiveType::XZRect: return finalizeRect<0, 2, 1>(store.rects[ref.index()], r, t, rec);
+	case PrimitiveType::Box:
+	{
+		// the slab test is cheap enough to repeat for the face the hit was on
+		const BoxPrim& b = store.boxes[ref.index()];
+		float tEnter, tExit;
+		int enterAxis, exitAxis;
+		Box::slab(b.boxMin, b.boxMax, r, tEnter, tExit, enterAxis, exitAxis);
+		Box::faceHit(b.boxMin, b.boxMax, r, t, t == tEnter ? enterAxis : exitAxis, rec);
+		rec.pMat = b.pMat;
+		return;
+	}
+	case PrimitiveType::Generic: return;
+	}
+}
+
+inline bool CompiledScene::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	const float tMin = static_cast<float>(t_min);
+	float closest = static_cast<float>(t_max);
+	bool hitAnything = false;
+	for (const auto& obj : unbounded)
+	{
+		if (obj->hit(r, tMin, closest, rec))
+		{
+			rec.materialId = hit_record::noMaterial;
+			hitAnything = true;
+			closest = static_cast<float>(rec.t);
+		}
+	}
+	// rec is only written by generic objects during traversal, a primitive winner is finalized after
+	PrimitiveRef winner = makeRef(PrimitiveType::Generic, 0);
+	uint32_t winnerSlot = 0;
+	hitAnything |= FlatBVH::traverse(nodes.empty() ? nullptr : nodes.data(), r, tMin, closest, [&](uint32_t first, uint32_t n, float& tMax)
+	{
+		bool hitLeaf = false;
+		for (uint32_t i = first; i < first + n; ++i)
+		{
+			if (hitPrimitive(prims[i], r, tMin, tMax, tMax, rec))
+			{
+				hitLeaf = true;
+				winner = prims[i];
+				winnerSlot = i;
+				closest = tMax;
+			}
+		}
+		return hitLeaf;
+	});
+	if (winner.type() != PrimitiveType::Generic)
+	{
+		finalize(winner, r, closest, rec);
+		rec.materialId = primMaterials[winnerSlot];
+	}
+	return hitAnything;
+}
+
+inline bool CompiledScene::boundingBox(float t0, float t1, aabb& outBox) const
+{
+	if (nodes.empty() || !unbounded.empty()) return false;
+	outBox = aabb(nodes[0].boxMin, nodes[0].boxMax);
+	return true;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hittable.h"
+#include "Instance.h"
 #include "material.h"
 #include "texture.h"
 
@@ -11,45 +12,42 @@ public:
 		: boundary(b), phaseFunction(make_shared<Isotropic>(a)) , negInvDensity(-1/d) {}
 	ConstantMedium(shared_ptr<hittable> b, float d, const vec3& c)
 		: boundary(b), phaseFunction(make_shared<Isotropic>(c)), negInvDensity(-1 / d) {}
+	ConstantMedium(shared_ptr<hittable> b, shared_ptr<material> phase, float negInvDensity)
+		: boundary(b), phaseFunction(phase), negInvDensity(negInvDensity) {}
 
-	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+	shared_ptr<hittable> folded() const override;
 private:
 	shared_ptr<hittable> boundary;
 	shared_ptr<material> phaseFunction;
 	float negInvDensity;
 };
 
-inline bool ConstantMedium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool ConstantMedium::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
 	const bool enableDebug = false;
-	const bool debugging = enableDebug && rtnextweek::random_double() < 0.00001;
+	const bool debugging = enableDebug && rtnextweek::random_float() < 0.00001f;
 
-	hit_record rec1, rec2;
+	real tEnter, tExit;
+	if (!boundary->hitInterval(r, tEnter, tExit)) return false;
 
-	float fMax = std::numeric_limits<float>::max();
-	float fMin = -fMax;
+	if(debugging) std::cerr << "\nt_min=" << tEnter << ", t_max=" << tExit << '\n';
 
-	// must hit twice(hit through boundary)
-	if (!boundary->hit(r, fMin, fMax, rec1)) return false;
-	if (!boundary->hit(r, rec1.t + 0.0001, fMax, rec2)) return false;
+	if (tEnter < t_min) tEnter = t_min;
+	if (tExit > t_max) tExit = t_max;
 
-	if(debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
+	if (tEnter >= tExit) return false;
 
-	if (rec1.t < t_min) rec1.t = t_min;
-	if (rec2.t > t_max) rec2.t = t_max;
-
-	if (rec1.t >= rec2.t) return false;
-
-	if (rec1.t < 0) rec1.t = 0;
+	if (tEnter < 0) tEnter = 0;
 
 	const auto rayLength = glm::length(r.direction());
-	const auto distanceInsideBoundary = (rec2.t - rec1.t) * rayLength;
-	const auto hitDistance = negInvDensity * log(rtnextweek::random_double());
+	const auto distanceInsideBoundary = (tExit - tEnter) * rayLength;
+	const auto hitDistance = negInvDensity * std::log(rtnextweek::random_float());
 
 	if (hitDistance > distanceInsideBoundary) return false;
 
-	rec.t = rec1.t + hitDistance / rayLength;
+	rec.t = tEnter + hitDistance / rayLength;
 	rec.p = r.at(rec.t);
 	if (debugging) {
 		std::cerr << "hitDistance = " << hitDistance << '\n'
@@ -57,13 +55,21 @@ inline bool ConstantMedium::hit(const ray& r, double t_min, double t_max, hit_re
 			<< "rec.p = " << rec.p.x << ' ' << rec.p.y << ' ' << rec.p.z << '\n';
 	}
 
+	rec.uvScale = 0.f;
 	rec.normal = vec3(1, 0, 0);  // arbitrary
 	rec.front_face = true;     // also arbitrary
-	rec.pMat = phaseFunction;
+	rec.pMat = phaseFunction.get();
 
 	return true;
 }
 
+inline shared_ptr<hittable> ConstantMedium::folded() const
+{
+	auto b = Instance::fold(boundary);
+	if (b == boundary) return nullptr;
+	return make_shared<ConstantMedium>(b, phaseFunction, negInvDensity);
+}
+
 inline bool ConstantMedium::boundingBox(float t0, float t1, aabb& outBox) const
 {
 	return boundary->boundingBox(t0, t1, outBox);
@@ -0,0 +1,142 @@
+#ifndef INSTANCE_H_
+#define INSTANCE_H_
+
+#include "hittable.h"
+
+// 3x4 affine transform stored as rows, the implied last row is (0, 0, 0, 1)
+struct Affine
+{
+	glm::vec4 rows[3];
+
+	static Affine fromMat4(const glm::mat4& m)
+	{
+		Affine a;
+		for (int i = 0; i < 3; i++) a.rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+		return a;
+	}
+	glm::mat4 toMat4() const
+	{
+		glm::mat4 m(1.f);
+		for (int i = 0; i < 3; i++)
+			for (int c = 0; c < 4; c++) m[c][i] = rows[i][c];
+		return m;
+	}
+	glm::vec3 point(const glm::vec3& p) const
+	{
+		return glm::vec3(linear(0, p) + rows[0].w, linear(1, p) + rows[1].w, linear(2, p) + rows[2].w);
+	}
+	glm::vec3 vector(const glm::vec3& v) const
+	{
+		return glm::vec3(linear(0, v), linear(1, v), linear(2, v));
+	}
+	// multiplies by the transposed linear part, applied to an inverse it maps normals
+	glm::vec3 transposedVector(const glm::vec3& v) const
+	{
+		return glm::vec3(rows[0].x * v.x + rows[1].x * v.y + rows[2].x * v.z,
+			rows[0].y * v.x + rows[1].y * v.y + rows[2].y * v.z,
+			rows[0].z * v.x + rows[1].z * v.y + rows[2].z * v.z);
+	}
+private:
+	float linear(int i, const glm::vec3& v) const { return rows[i].x * v.x + rows[i].y * v.y + rows[i].z * v.z; }
+};
+
+// An object placed in the world by an arbitrary affine transform. The ray is moved into
+// object space with one matrix multiply, hits are moved back the same way.
+class Instance : public hittable
+{
+public:
+	Instance(shared_ptr<hittable> object, const glm::mat4& objectToWorld);
+
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+	bool hitInterval(const ray& r, real& tEnter, real& tExit) const override;
+	bool asTransform(glm::mat4& objectToWorld, shared_ptr<hittable>& child) const override;
+
+	// collapses a chain of two or more transform wrappers (Translate, RotateY, Instance) into
+	// one Instance, and lets other objects fold the ones they wrap. Returns obj if unchanged.
+	static shared_ptr<hittable> fold(const shared_ptr<hittable>& obj);
+private:
+	ray toObject(const ray& r) const
+	{
+		return ray(worldToObject.point(r.origin()), worldToObject.vector(r.direction()), r.time());
+	}
+
+	shared_ptr<hittable> object;
+	Affine objectToWorld;
+	Affine worldToObject;
+	bool hasBox;
+	aabb box;
+};
+
+inline Instance::Instance(shared_ptr<hittable> object, const glm::mat4& objectToWorld)
+	: object(std::move(object)), objectToWorld(Affine::fromMat4(objectToWorld)),
+	worldToObject(Affine::fromMat4(glm::inverse(objectToWorld)))
+{
+	aabb local;
+	hasBox = this->object->boundingBox(0, 1, local);
+	if (!hasBox) return;
+	float fMax = std::numeric_limits<float>::max();
+	glm::vec3 min(fMax, fMax, fMax);
+	glm::vec3 max(-fMax, -fMax, -fMax);
+	for (int i = 0; i < 8; i++)
+	{
+		const glm::vec3 corner((i & 1 ? local.max() : local.min()).x, (i & 2 ? local.max() : local.min()).y,
+			(i & 4 ? local.max() : local.min()).z);
+		const glm::vec3 p = this->objectToWorld.point(corner);
+		for (int c = 0; c < 3; c++)
+		{
+			min[c] = fmin(min[c], p[c]);
+			max[c] = fmax(max[c], p[c]);
+		}
+	}
+	box = aabb(min, max);
+}
+
+inline bool Instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	// the direction is not normalized, so t means the same along both rays
+	if (!object->hit(toObject(r), t_min, t_max, rec)) return false;
+	rec.p = objectToWorld.point(rec.p);
+	const glm::vec3 outward = rec.front_face ? rec.normal : -rec.normal;
+	rec.set_face_normal(r, glm::normalize(worldToObject.transposedVector(outward)));
+	return true;
+}
+
+inline bool Instance::boundingBox(float t0, float t1, aabb& outBox) const
+{
+	outBox = box;
+	return hasBox;
+}
+
+inline bool Instance::hitInterval(const ray& r, real& tEnter, real& tExit) const
+{
+	return object->hitInterval(toObject(r), tEnter, tExit);
+}
+
+inline bool Instance::asTransform(glm::mat4& objectToWorld, shared_ptr<hittable>& child) const
+{
+	objectToWorld = this->objectToWorld.toMat4();
+	child = object;
+	return true;
+}
+
+inline shared_ptr<hittable> Instance::fold(const shared_ptr<hittable>& obj)
+{
+	glm::mat4 total(1.f);
+	glm::mat4 m;
+	shared_ptr<hittable> leaf = obj;
+	shared_ptr<hittable> child;
+	int depth = 0;
+	while (leaf->asTransform(m, child))
+	{
+		total = total * m;
+		leaf = child;
+		++depth;
+	}
+	const shared_ptr<hittable> unfolded = leaf;
+	if (auto inner = leaf->folded()) leaf = inner;
+	if (depth >= 2 || (depth == 1 && leaf != unfolded)) return make_shared<Instance>(leaf, total);
+	return depth == 0 ? leaf : obj;
+}
+
+#endif
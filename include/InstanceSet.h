@@ -0,0 +1,140 @@
+#ifndef INSTANCESET_H_
+#define INSTANCESET_H_
+
+#include "hittable.h"
+#include "flatbvh.h"
+#include "Instance.h"
+
+// Many placed copies of a few prototype objects. An instance is only its world-to-object
+// transform plus a prototype and material index, the set keeps one BVH over all of them.
+// Hit points are taken from the world ray, so the forward transform is never stored.
+class InstanceSet : public hittable
+{
+public:
+	static constexpr uint16_t keepMaterial = 0xffff;
+
+	uint16_t addPrototype(shared_ptr<hittable> object);
+	uint16_t addMaterial(shared_ptr<material> mat);
+	// material overrides the prototype's own material unless it is keepMaterial
+	void add(uint16_t prototype, const glm::mat4& objectToWorld, uint16_t material = keepMaterial);
+	// builds the BVH over everything added so far, must be called before the set is hit
+	void build();
+	size_t size() const { return records.size(); }
+	// bytes held by the instance records and the BVH, prototypes not included
+	size_t memoryUsage() const { return records.capacity() * sizeof(Record) + nodes.capacity() * sizeof(FlatBVHNode); }
+
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+private:
+	struct Record
+	{
+		Affine worldToObject;
+		uint16_t prototype;
+		uint16_t material;
+	};
+	static constexpr uint32_t leafSize = 4;
+
+	std::vector<shared_ptr<hittable>> prototypes;
+	std::vector<aabb> prototypeBounds;
+	std::vector<shared_ptr<material>> materials;
+	std::vector<Record> records;
+	std::vector<FlatBVHNode> nodes;
+	aabb box;
+};
+
+inline uint16_t InstanceSet::addPrototype(shared_ptr<hittable> object)
+{
+	aabb bounds;
+	if (!object->boundingBox(0, 1, bounds)) bounds = aabb(glm::vec3(0.f), glm::vec3(0.f));
+	prototypes.push_back(std::move(object));
+	prototypeBounds.push_back(bounds);
+	return static_cast<uint16_t>(prototypes.size() - 1);
+}
+
+inline uint16_t InstanceSet::addMaterial(shared_ptr<material> mat)
+{
+	materials.push_back(std::move(mat));
+	return static_cast<uint16_t>(materials.size() - 1);
+}
+
+inline void InstanceSet::add(uint16_t prototype, const glm::mat4& objectToWorld, uint16_t material)
+{
+	records.push_back({ Affine::fromMat4(glm::inverse(objectToWorld)), prototype, material });
+}
+
+inline void InstanceSet::build()
+{
+	std::vector<aabb> bounds;
+	bounds.reserve(records.size());
+	const float fMax = std::numeric_limits<float>::max();
+	for (const Record& inst : records)
+	{
+		const Affine toWorld = Affine::fromMat4(glm::inverse(inst.worldToObject.toMat4()));
+		const aabb& local = prototypeBounds[inst.prototype];
+		glm::vec3 min(fMax, fMax, fMax);
+		glm::vec3 max(-fMax, -fMax, -fMax);
+		for (int i = 0; i < 8; i++)
+		{
+			const glm::vec3 corner((i & 1 ? local.max() : local.min()).x, (i & 2 ? local.max() : local.min()).y,
+				(i & 4 ? local.max() : local.min()).z);
+			const glm::vec3 p = toWorld.point(corner);
+			for (int c = 0; c < 3; c++)
+			{
+				min[c] = fmin(min[c], p[c]);
+				max[c] = fmax(max[c], p[c]);
+			}
+		}
+		bounds.emplace_back(min, max);
+	}
+
+	FlatBVH bvh;
+	bvh.build(std::move(bounds), leafSize);
+	nodes = bvh.nodes();
+	nodes.shrink_to_fit();
+	box = bvh.bounds();
+
+	// records in leaf order, so a leaf reads consecutive instances
+	std::vector<Record> ordered;
+	ordered.reserve(records.size());
+	for (uint32_t slot : bvh.order()) ordered.push_back(records[slot]);
+	records.swap(ordered);
+}
+
+inline bool InstanceSet::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	const float tMin = static_cast<float>(t_min);
+	const Record* winner = nullptr;
+	FlatBVH::traverse(nodes.empty() ? nullptr : nodes.data(), r, tMin, static_cast<float>(t_max), [&](uint32_t first, uint32_t n, float& tMax)
+	{
+		bool hitLeaf = false;
+		for (uint32_t i = first; i < first + n; ++i)
+		{
+			const Record& inst = records[i];
+			const ray local(inst.worldToObject.point(r.origin()), inst.worldToObject.vector(r.direction()), r.time());
+			if (prototypes[inst.prototype]->hit(local, tMin, tMax, rec))
+			{
+				hitLeaf = true;
+				tMax = static_cast<float>(rec.t);
+				winner = &inst;
+			}
+		}
+		return hitLeaf;
+	});
+	if (!winner) return false;
+
+	// rec is in object space, t is the same along both rays since the direction is not normalized
+	rec.p = r.at(rec.t);
+	const glm::vec3 outward = rec.front_face ? rec.normal : -rec.normal;
+	rec.set_face_normal(r, glm::normalize(winner->worldToObject.transposedVector(outward)));
+	if (winner->material != keepMaterial) rec.pMat = materials[winner->material].get();
+	return true;
+}
+
+inline bool InstanceSet::boundingBox(float t0, float t1, aabb& outBox) const
+{
+	if (nodes.empty()) return false;
+	outBox = box;
+	return true;
+}
+
+#endif
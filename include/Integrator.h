@@ -0,0 +1,114 @@
+#ifndef INTEGRATOR_H_
+#define INTEGRATOR_H_
+
+#include "LightTree.h"
+#include "MaterialTable.h"
+
+// Path tracer. At every hit whose material has a BSDF, one light is sampled directly and
+// tested with a shadow ray, and the light and BSDF samples are weighted against each other
+// with the power heuristic so small lights converge without losing large or glossy ones.
+// Lights are picked through a LightTree by their estimated contribution at the hit.
+// Specular materials just follow their sample(). Lights are the emissive spheres and rects of the
+// scene, objects that only lower to something else still emit when a path hits them.
+// Shading goes through the world's MaterialTable when it has one. Textures are filtered over
+// a ray cone from the camera's pixel spread, widened by the length of the path so far.
+class Integrator
+{
+public:
+	Integrator(const hittable& world, const vec3& background, int maxDepth);
+	vec3 radiance(const ray& r) const;
+	size_t lightCount() const { return lightTree.size(); }
+	// angle a single sample stands for: the pixel spread over sqrt(samples per pixel).
+	// 0 leaves texture lookups unfiltered.
+	void setPixelSpread(float radians) { pixelSpread = radians; }
+private:
+	// light arriving at rec from one sampled light, already weighted against BSDF sampling
+	vec3 sampleLight(const ray& rIn, const hit_record& rec) const;
+	// density with which light sampling from p picks direction wi, the ray hits a light at distance
+	float lightPdf(const glm::vec3& p, const glm::vec3& wi, float distance) const;
+	static float powerHeuristic(float pdf, float otherPdf)
+	{
+		return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+	}
+
+	const hittable& world;
+	const MaterialTable* materials;		// never null, empty when the world has no table
+	MaterialTable virtualMaterials;
+	vec3 background;
+	int maxDepth;
+	float pixelSpread = 0.f;
+	LightTree lightTree;
+};
+
+inline Integrator::Integrator(const hittable& world, const vec3& background, int maxDepth)
+	: world(world), materials(world.materials() ? world.materials() : &virtualMaterials), background(background), maxDepth(maxDepth), lightTree(lights::collect(world)) {}
+
+inline vec3 Integrator::sampleLight(const ray& rIn, const hit_record& rec) const
+{
+	float pick;
+	const LightPrim* light = lightTree.sample(rec.p, rtnextweek::random_float(), pick);
+	lights::LightSample ls;
+	if (!light || !lights::sample(*light, rec.p, ls)) return vec3(0.f);
+	const vec3 f = materials->evaluate(rIn, rec, ls.wi);
+	if (f == vec3(0.f) || ls.radiance == vec3(0.f)) return vec3(0.f);
+
+	hit_record blocker;
+	if (world.hit(ray(rec.p, ls.wi, rIn.time()), .001, ls.distance * .999f, blocker)) return vec3(0.f);
+	const float pdf = ls.pdf * pick;
+	return f * ls.radiance * (powerHeuristic(pdf, materials->pdf(rIn, rec, ls.wi)) / pdf);
+}
+
+inline float Integrator::lightPdf(const glm::vec3& p, const glm::vec3& wi, float distance) const
+{
+	const int light = lightTree.find(p, wi, distance);
+	if (light < 0) return 0.f;
+	return lightTree.pmf(p, static_cast<uint32_t>(light)) * lights::pdf(lightTree.light(light), p, wi);
+}
+
+inline vec3 Integrator::radiance(const ray& primary) const
+{
+	vec3 color(0.f);
+	vec3 throughput(1.f);
+	ray r = primary;
+	// whether the last bounce can be found by light sampling, and how likely its direction was
+	bool specular = true;
+	float bsdfPdf = 0.f;
+	glm::vec3 origin(0.f);
+	float pathLength = 0.f;
+	for (int depth = 0; depth < maxDepth; ++depth)
+	{
+		hit_record record;
+		if (!world.hit(r, .001, std::numeric_limits<real>::infinity(), record))
+		{
+			color += throughput * background;
+			break;
+		}
+		pathLength += static_cast<float>(record.t) * glm::length(r.direction());
+		record.footprint = pixelSpread * pathLength;
+
+		const vec3 emitted = materials->emitted(record);
+		if (emitted != vec3(0.f))
+		{
+			float weight = 1.f;
+			if (!specular)
+			{
+				const float length = glm::length(r.direction());
+				const float pdf = lightPdf(origin, r.direction() / length, static_cast<float>(record.t) * length);
+				weight = powerHeuristic(bsdfPdf, pdf);
+			}
+			color += throughput * emitted * weight;
+		}
+		color += throughput * sampleLight(r, record);
+
+		ScatterRecord bounce;
+		if (!materials->sample(r, record, bounce)) break;
+		bsdfPdf = bounce.pdf;
+		specular = bsdfPdf <= 0.f;
+		origin = record.p;
+		throughput *= bounce.weight;
+		r = bounce.scattered;
+	}
+	return color;
+}
+
+#endif
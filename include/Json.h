@@ -0,0 +1,245 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal JSON reader for scene files. The whole document is parsed into a tree of values,
+// objects keep their keys in file order. Numbers are doubles, there is no writer.
+namespace json
+{
+	class Value
+	{
+	public:
+		enum class Type { Null, Bool, Number, String, Array, Object };
+
+		Type type = Type::Null;
+		bool boolean = false;
+		double number = 0.0;
+		std::string string;
+		std::vector<Value> array;
+		std::vector<std::pair<std::string, Value>> members;
+
+		bool isNumber() const { return type == Type::Number; }
+		bool isString() const { return type == Type::String; }
+		bool isArray() const { return type == Type::Array; }
+		bool isObject() const { return type == Type::Object; }
+		// member named key, or nullptr if this is not an object or has no such member
+		const Value* find(const char* key) const;
+	};
+
+	// parses text into out, on failure error holds the line and the reason
+	bool parse(const std::string& text, Value& out, std::string& error);
+}
+
+inline const json::Value* json::Value::find(const char* key) const
+{
+	for (const auto& member : members)
+		if (member.first == key) return &member.second;
+	return nullptr;
+}
+
+namespace json
+{
+	namespace detail
+	{
+		struct Parser
+		{
+			const char* p;
+			const char* end;
+			int line = 1;
+			std::string error;
+
+			bool fail(const char* reason)
+			{
+				if (error.empty()) error = "line " + std::to_string(line) + ": " + reason;
+				return false;
+			}
+			void skipSpace()
+			{
+				while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+				{
+					if (*p == '\n') ++line;
+					++p;
+				}
+			}
+			bool literal(const char* word)
+			{
+				const size_t n = std::strlen(word);
+				if (static_cast<size_t>(end - p) < n || std::strncmp(p, word, n) != 0) return fail("unexpected token");
+				p += n;
+				return true;
+			}
+			bool parseString(std::string& out);
+			bool parseValue(Value& out, int depth);
+		};
+
+		inline void appendUtf8(std::string& out, uint32_t c)
+		{
+			if (c < 0x80) out += static_cast<char>(c);
+			else if (c < 0x800)
+			{
+				out += static_cast<char>(0xc0 | (c >> 6));
+				out += static_cast<char>(0x80 | (c & 0x3f));
+			}
+			else if (c < 0x10000)
+			{
+				out += static_cast<char>(0xe0 | (c >> 12));
+				out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+				out += static_cast<char>(0x80 | (c & 0x3f));
+			}
+			else
+			{
+				out += static_cast<char>(0xf0 | (c >> 18));
+				out += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+				out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+				out += static_cast<char>(0x80 | (c & 0x3f));
+			}
+		}
+
+		inline bool Parser::parseString(std::string& out)
+		{
+			++p; // opening quote
+			auto hex4 = [this](uint32_t& c)
+			{
+				if (end - p < 4) return false;
+				c = 0;
+				for (int i = 0; i < 4; i++, p++)
+				{
+					const char h = *p;
+					c <<= 4;
+					if (h >= '0' && h <= '9') c |= h - '0';
+					else if (h >= 'a' && h <= 'f') c |= h - 'a' + 10;
+					else if (h >= 'A' && h <= 'F') c |= h - 'A' + 10;
+					else return false;
+				}
+				return true;
+			};
+			while (p < end && *p != '"')
+			{
+				if (*p == '\n') return fail("unterminated string");
+				if (*p != '\\')
+				{
+					out += *p++;
+					continue;
+				}
+				if (++p == end) break;
+				const char e = *p++;
+				switch (e)
+				{
+				case '"': out += '"'; break;
+				case '\\': out += '\\'; break;
+				case '/': out += '/'; break;
+				case 'b': out += '\b'; break;
+				case 'f': out += '\f'; break;
+				case 'n': out += '\n'; break;
+				case 'r': out += '\r'; break;
+				case 't': out += '\t'; break;
+				case 'u':
+				{
+					uint32_t c;
+					if (!hex4(c)) return fail("bad \\u escape");
+					// a high surrogate is combined with the low one that follows it
+					uint32_t low;
+					if (c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+					{
+						p += 2;
+						if (!hex4(low) || low < 0xdc00 || low >= 0xe000) return fail("bad surrogate pair");
+						c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+					}
+					appendUtf8(out, c);
+					break;
+				}
+				default: return fail("bad escape");
+				}
+			}
+			if (p == end) return fail("unterminated string");
+			++p; // closing quote
+			return true;
+		}
+
+		inline bool Parser::parseValue(Value& out, int depth)
+		{
+			if (depth > 256) return fail("nesting too deep");
+			skipSpace();
+			if (p == end) return fail("unexpected end of input");
+			switch (*p)
+			{
+			case '{':
+				out.type = Value::Type::Object;
+				++p;
+				skipSpace();
+				if (p < end && *p == '}') { ++p; return true; }
+				for (;;)
+				{
+					skipSpace();
+					if (p == end || *p != '"') return fail("expected a member name");
+					std::string key;
+					if (!parseString(key)) return false;
+					skipSpace();
+					if (p == end || *p != ':') return fail("expected ':'");
+					++p;
+					out.members.emplace_back(std::move(key), Value());
+					if (!parseValue(out.members.back().second, depth + 1)) return false;
+					skipSpace();
+					if (p < end && *p == ',') { ++p; continue; }
+					if (p < end && *p == '}') { ++p; return true; }
+					return fail("expected ',' or '}'");
+				}
+			case '[':
+				out.type = Value::Type::Array;
+				++p;
+				skipSpace();
+				if (p < end && *p == ']') { ++p; return true; }
+				for (;;)
+				{
+					out.array.emplace_back();
+					if (!parseValue(out.array.back(), depth + 1)) return false;
+					skipSpace();
+					if (p < end && *p == ',') { ++p; continue; }
+					if (p < end && *p == ']') { ++p; return true; }
+					return fail("expected ',' or ']'");
+				}
+			case '"':
+				out.type = Value::Type::String;
+				return parseString(out.string);
+			case 't':
+				out.type = Value::Type::Bool;
+				out.boolean = true;
+				return literal("true");
+			case 'f':
+				out.type = Value::Type::Bool;
+				return literal("false");
+			case 'n':
+				return literal("null");
+			default:
+			{
+				// the text is null terminated, strtod stops at the first character that isn't part of the number
+				char* stop;
+				out.number = std::strtod(p, &stop);
+				if (stop == p) return fail("unexpected character");
+				out.type = Value::Type::Number;
+				p = stop;
+				return true;
+			}
+			}
+		}
+	}
+}
+
+inline bool json::parse(const std::string& text, Value& out, std::string& error)
+{
+	detail::Parser parser{ text.c_str(), text.c_str() + text.size() };
+	out = Value();
+	bool ok = parser.parseValue(out, 0);
+	parser.skipSpace();
+	if (ok && parser.p != parser.end) ok = parser.fail("trailing characters");
+	error = parser.error;
+	return ok;
+}
+
+#endif
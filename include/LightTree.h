@@ -0,0 +1,253 @@
+#ifndef LIGHTTREE_H_
+#define LIGHTTREE_H_
+
+#include "Lights.h"
+#include "flatbvh.h"
+
+// BVH over the lights of a scene that picks one light for a shading point in proportion to an
+// estimate of its contribution there (Conty Estevez and Kulla 2018). Every node keeps the
+// emitted power, bounds and a cone bounding the emission directions of the lights below it;
+// sampling walks down choosing children by importance, so the pick costs O(log n) and lights
+// that are far away, dim or facing away are rarely chosen however many there are.
+class LightTree
+{
+public:
+	explicit LightTree(vector<LightPrim> lights);
+	size_t size() const { return lights.size(); }
+
+	// a light for shading point p and its probability, nullptr if no light can reach p
+	const LightPrim* sample(const glm::vec3& p, float u, float& pmf) const;
+	// the light that p + t * wi hits at t = distance, or -1
+	int find(const glm::vec3& p, const glm::vec3& wi, float distance) const;
+	// probability that sample(p) picks light i
+	float pmf(const glm::vec3& p, uint32_t i) const;
+	const LightPrim& light(uint32_t i) const { return lights[i]; }
+private:
+	// what a node knows about the lights below it
+	struct LightBounds
+	{
+		glm::vec3 boxMin;
+		float power;
+		glm::vec3 boxMax;
+		float cosTheta_o;		// emission normals lie within this angle of axis
+		glm::vec3 axis;
+		float cosTheta_e;		// and light leaves within this angle of each normal
+		bool twoSided;
+	};
+	static LightBounds boundsOf(const LightPrim& light);
+	static LightBounds merge(const LightBounds& a, const LightBounds& b);
+	static float importance(const LightBounds& b, const glm::vec3& p);
+
+	vector<LightPrim> lights;			// in leaf order
+	vector<FlatBVHNode> nodes;
+	vector<LightBounds> nodeBounds;		// one per node
+	vector<uint32_t> parents;			// per node, the root is its own parent
+	vector<uint32_t> leafOf;			// per light, the leaf holding it
+};
+
+inline LightTree::LightBounds LightTree::boundsOf(const LightPrim& light)
+{
+	LightBounds b;
+	const float pi = glm::pi<float>();
+	b.cosTheta_e = 0.f;		// diffuse emitters light the whole hemisphere over each normal
+	if (light.type == PrimitiveType::Sphere)
+	{
+		const SpherePrim& s = light.sphere;
+		const vec3 L = s.pMat->emitted(.5f, .5f, s.center + glm::vec3(0.f, s.radius, 0.f));
+		b.boxMin = s.center - glm::vec3(s.radius);
+		b.boxMax = s.center + glm::vec3(s.radius);
+		b.power = (L.x + L.y + L.z) / 3.f * 4.f * pi * s.radius * s.radius * pi;
+		b.axis = glm::vec3(0, 0, 1);
+		b.cosTheta_o = -1.f;
+		b.twoSided = false;
+		return b;
+	}
+	int a, c, k;
+	lights::detail::rectAxes(light.type, a, c, k);
+	const RectPrim& q = light.rect;
+	const glm::vec3 center = lights::detail::rectPoint(q, a, c, k, .5f * (q.a0 + q.a1), .5f * (q.b0 + q.b1));
+	const vec3 L = q.pMat->emitted(.5f, .5f, center);
+	b.boxMin = lights::detail::rectPoint(q, a, c, k, q.a0, q.b0);
+	b.boxMax = lights::detail::rectPoint(q, a, c, k, q.a1, q.b1);
+	b.boxMin[k] -= 0.0001f;
+	b.boxMax[k] += 0.0001f;
+	// DiffuseLight emits from both faces
+	b.power = (L.x + L.y + L.z) / 3.f * lights::detail::rectArea(q) * pi * 2.f;
+	b.axis = glm::vec3(0.f);
+	b.axis[k] = 1.f;
+	b.cosTheta_o = 1.f;
+	b.twoSided = true;
+	return b;
+}
+
+inline LightTree::LightBounds LightTree::merge(const LightBounds& a, const LightBounds& b)
+{
+	if (a.power <= 0.f) return b;
+	if (b.power <= 0.f) return a;
+	LightBounds m;
+	m.boxMin = glm::min(a.boxMin, b.boxMin);
+	m.boxMax = glm::max(a.boxMax, b.boxMax);
+	m.power = a.power + b.power;
+	m.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+	m.twoSided = a.twoSided || b.twoSided;
+
+	// smallest cone holding both normal cones
+	const float pi = glm::pi<float>();
+	const float thetaA = std::acos(glm::clamp(a.cosTheta_o, -1.f, 1.f));
+	const float thetaB = std::acos(glm::clamp(b.cosTheta_o, -1.f, 1.f));
+	const float thetaD = std::acos(glm::clamp(dot(a.axis, b.axis), -1.f, 1.f));
+	m.axis = a.axis;
+	m.cosTheta_o = -1.f;
+	if (std::min(thetaD + thetaB, pi) <= thetaA) m.cosTheta_o = a.cosTheta_o;
+	else if (std::min(thetaD + thetaA, pi) <= thetaB) m.axis = b.axis, m.cosTheta_o = b.cosTheta_o;
+	else
+	{
+		const float thetaO = .5f * (thetaA + thetaD + thetaB);
+		const glm::vec3 w = cross(a.axis, b.axis);
+		if (thetaO < pi && dot(w, w) > 0.f)
+		{
+			// rotate a's axis towards b's until the cone touches both
+			const glm::vec3 n = normalize(w);
+			const float thetaR = thetaO - thetaA;
+			m.axis = std::cos(thetaR) * a.axis + std::sin(thetaR) * cross(n, a.axis) + (1.f - std::cos(thetaR)) * dot(n, a.axis) * n;
+			m.cosTheta_o = std::cos(thetaO);
+		}
+	}
+	return m;
+}
+
+inline float LightTree::importance(const LightBounds& b, const glm::vec3& p)
+{
+	if (b.power <= 0.f) return 0.f;
+	const glm::vec3 center = .5f * (b.boxMin + b.boxMax);
+	const glm::vec3 toPoint = p - center;
+	// distance is clamped to the box size so points inside or near a node don't blow up
+	const float halfDiagonal = .5f * glm::length(b.boxMax - b.boxMin);
+	const float d2 = std::max(dot(toPoint, toPoint), halfDiagonal * halfDiagonal);
+	if (b.cosTheta_o <= -1.f || dot(toPoint, toPoint) <= 0.f) return b.power / d2;
+
+	// the smallest angle between an emission normal and the direction to p, given that the
+	// lights can be anywhere in the box, must leave p inside the emission hemisphere
+	const glm::vec3 wi = toPoint / std::sqrt(dot(toPoint, toPoint));
+	float cosTheta_w = dot(b.axis, wi);
+	if (b.twoSided) cosTheta_w = std::fabs(cosTheta_w);
+	const float sin2Bounds = halfDiagonal * halfDiagonal / dot(toPoint, toPoint);
+	const float thetaBounds = sin2Bounds >= 1.f ? glm::pi<float>() : std::asin(std::sqrt(sin2Bounds));
+	const float theta = std::acos(glm::clamp(cosTheta_w, -1.f, 1.f)) - std::acos(glm::clamp(b.cosTheta_o, -1.f, 1.f)) - thetaBounds;
+	const float cosThetaP = theta > 0.f ? std::cos(theta) : 1.f;
+	if (cosThetaP <= b.cosTheta_e) return 0.f;
+	return b.power * cosThetaP / d2;
+}
+
+inline LightTree::LightTree(vector<LightPrim> lightList)
+{
+	if (lightList.empty()) return;
+	vector<aabb> bounds;
+	vector<LightBounds> leafBounds;
+	for (const LightPrim& light : lightList)
+	{
+		leafBounds.push_back(boundsOf(light));
+		bounds.emplace_back(leafBounds.back().boxMin, leafBounds.back().boxMax);
+	}
+	FlatBVH bvh;
+	bvh.build(std::move(bounds), 1);
+	nodes = bvh.nodes();
+	for (uint32_t slot : bvh.order()) lights.push_back(lightList[slot]);
+
+	// children come after their parent, so a backwards pass sees them first
+	nodeBounds.resize(nodes.size());
+	parents.resize(nodes.size());
+	leafOf.resize(lights.size());
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		const FlatBVHNode& node = nodes[i];
+		if (node.count > 0)
+		{
+			for (uint32_t j = 0; j < node.count; j++) leafOf[node.offset + j] = static_cast<uint32_t>(i);
+			LightBounds b = leafBounds[bvh.order()[node.offset]];
+			for (uint32_t j = 1; j < node.count; j++) b = merge(b, leafBounds[bvh.order()[node.offset + j]]);
+			nodeBounds[i] = b;
+		}
+		else
+		{
+			nodeBounds[i] = merge(nodeBounds[i + 1], nodeBounds[node.offset]);
+			parents[i + 1] = parents[node.offset] = static_cast<uint32_t>(i);
+		}
+	}
+}
+
+inline const LightPrim* LightTree::sample(const glm::vec3& p, float u, float& pmf) const
+{
+	if (nodes.empty()) return nullptr;
+	pmf = 1.f;
+	uint32_t index = 0;
+	while (nodes[index].count == 0)
+	{
+		const uint32_t left = index + 1, right = nodes[index].offset;
+		const float iLeft = importance(nodeBounds[left], p);
+		const float iRight = importance(nodeBounds[right], p);
+		if (iLeft <= 0.f && iRight <= 0.f) return nullptr;
+		const float pLeft = iLeft / (iLeft + iRight);
+		if (u < pLeft)
+		{
+			u = std::min(u / pLeft, 0.99999994f);
+			pmf *= pLeft;
+			index = left;
+		}
+		else
+		{
+			u = std::min((u - pLeft) / (1.f - pLeft), 0.99999994f);
+			pmf *= 1.f - pLeft;
+			index = right;
+		}
+	}
+	if (importance(nodeBounds[index], p) <= 0.f) return nullptr;
+	// leaves only hold several lights when the build ran out of depth, they share uniformly
+	const FlatBVHNode& leaf = nodes[index];
+	const uint32_t pick = std::min(leaf.count - 1, static_cast<uint32_t>(u * leaf.count));
+	pmf /= leaf.count;
+	return &lights[leaf.offset + pick];
+}
+
+inline float LightTree::pmf(const glm::vec3& p, uint32_t light) const
+{
+	// the choices sample() makes on the way down, multiplied from the leaf up so any depth works
+	const uint32_t leaf = leafOf[light];
+	if (importance(nodeBounds[leaf], p) <= 0.f) return 0.f;
+	float pmf = 1.f / nodes[leaf].count;
+	for (uint32_t index = leaf; index != 0;)
+	{
+		const uint32_t parent = parents[index];
+		const uint32_t left = parent + 1, right = nodes[parent].offset;
+		const float iLeft = importance(nodeBounds[left], p);
+		const float iRight = importance(nodeBounds[right], p);
+		if (iLeft <= 0.f && iRight <= 0.f) return 0.f;
+		pmf *= (index == right ? iRight : iLeft) / (iLeft + iRight);
+		index = parent;
+	}
+	return pmf;
+}
+
+inline int LightTree::find(const glm::vec3& p, const glm::vec3& wi, float distance) const
+{
+	if (nodes.empty()) return -1;
+	const ray r(p, wi);
+	int found = -1;
+	FlatBVH::traverse(nodes.data(), r, 0.f, distance * 1.001f + 0.001f, [&](uint32_t first, uint32_t n, float& tMax)
+	{
+		for (uint32_t i = first; i < first + n; ++i)
+		{
+			const float t = lights::intersect(lights[i], p, wi);
+			if (t >= 0.f && std::fabs(t - distance) <= 1e-3f * std::max(1.f, distance))
+			{
+				found = static_cast<int>(i);
+				tMax = t;
+				return true;
+			}
+		}
+		return false;
+	});
+	return found;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef LIGHTS_H_
+#define LIGHTS_H_
+
+#include "material.h"
+#include "rtnextweek.h"
+
+// Sampling of points on emissive shapes as seen from a shading point. Rects are sampled by
+// area, spheres by the cone of directions they cover, which wastes no samples on the far
+// side. Densities are per solid angle at the shading point so they compare with BSDF pdfs.
+namespace lights
+{
+	struct LightSample
+	{
+		glm::vec3 wi;		// unit direction from the shading point to the sampled point
+		float distance;
+		glm::vec3 radiance;
+		float pdf;
+	};
+
+	// keeps the shapes of the scene whose material is emissive
+	vector<LightPrim> collect(const hittable& world);
+	bool sample(const LightPrim& light, const glm::vec3& p, LightSample& out);
+	// density of sample() producing direction wi from p, 0 if the ray misses the light
+	float pdf(const LightPrim& light, const glm::vec3& p, const glm::vec3& wi);
+	// closest point along p + t * wi on the light, or a negative t if it is missed
+	float intersect(const LightPrim& light, const glm::vec3& p, const glm::vec3& wi);
+
+	namespace detail
+	{
+		// axes of the rect types: the rect spans A and B at K
+		inline void rectAxes(PrimitiveType type, int& a, int& b, int& k)
+		{
+			if (type == PrimitiveType::XYRect) a = 0, b = 1, k = 2;
+			else if (type == PrimitiveType::YZRect) a = 1, b = 2, k = 0;
+			else a = 0, b = 2, k = 1;
+		}
+		inline float rectArea(const RectPrim& q) { return (q.a1 - q.a0) * (q.b1 - q.b0); }
+		// 1 - cosine of the half angle of the cone the sphere covers seen from p, -1 if p is inside.
+		// Written so it keeps its precision for small and distant spheres.
+		inline float coneSpread(const SpherePrim& s, const glm::vec3& p)
+		{
+			const glm::vec3 toCenter = s.center - p;
+			const float x = s.radius * s.radius / dot(toCenter, toCenter);
+			if (!(x < 1.f)) return -1.f;
+			return x / (1.f + std::sqrt(1.f - x));
+		}
+		inline glm::vec3 rectPoint(const RectPrim& q, int a, int b, int k, float x, float y)
+		{
+			glm::vec3 point;
+			point[a] = x;
+			point[b] = y;
+			point[k] = q.k;
+			return point;
+		}
+	}
+}
+
+inline vector<LightPrim> lights::collect(const hittable& world)
+{
+	vector<LightPrim> candidates, emissive;
+	world.collectLights(candidates);
+	for (const LightPrim& light : candidates)
+		if (light.pMat() && light.pMat()->isEmissive()) emissive.push_back(light);
+	return emissive;
+}
+
+inline float lights::intersect(const LightPrim& light, const glm::vec3& p, const glm::vec3& wi)
+{
+	if (light.type == PrimitiveType::Sphere)
+	{
+		real t;
+		return sphere::intersect(light.sphere.center, light.sphere.radius, ray(p, wi), real(0), std::numeric_limits<real>::max(), t)
+			? static_cast<float>(t) : -1.f;
+	}
+	int a, b, k;
+	detail::rectAxes(light.type, a, b, k);
+	const RectPrim& q = light.rect;
+	const float t = (q.k - p[k]) / wi[k];
+	if (!(t > 0.f)) return -1.f;
+	const float x = p[a] + t * wi[a];
+	const float y = p[b] + t * wi[b];
+	return x < q.a0 || x > q.a1 || y < q.b0 || y > q.b1 ? -1.f : t;
+}
+
+inline bool lights::sample(const LightPrim& light, const glm::vec3& p, LightSample& out)
+{
+	const float u1 = rtnextweek::random_float();
+	const float u2 = rtnextweek::random_float();
+	glm::vec3 point;
+	float u, v;
+	if (light.type == PrimitiveType::Sphere)
+	{
+		const SpherePrim& s = light.sphere;
+		const float spread = detail::coneSpread(s, p);
+		if (spread < 0.f) return false;	// inside the light, it is found by the BSDF samples
+		// uniform direction in the cone around the center, then the point it sees
+		const glm::vec3 w = normalize(s.center - p);
+		const glm::vec3 helper = std::fabs(w.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+		const glm::vec3 tu = normalize(cross(helper, w));
+		const glm::vec3 tv = cross(w, tu);
+		const float cosTheta = 1.f - u1 * spread;
+		const float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+		const float phi = 2.f * glm::pi<float>() * u2;
+		out.wi = normalize(cosTheta * w + sinTheta * (std::cos(phi) * tu + std::sin(phi) * tv));
+		out.distance = intersect(light, p, out.wi);
+		if (out.distance < 0.f) return false;
+		out.pdf = 1.f / (2.f * glm::pi<float>() * spread);
+		point = p + out.distance * out.wi;
+		sphere::get_sphere_uv((point - s.center) / s.radius, u, v);
+	}
+	else
+	{
+		int a, b, k;
+		detail::rectAxes(light.type, a, b, k);
+		const RectPrim& q = light.rect;
+		point = detail::rectPoint(q, a, b, k, q.a0 + u1 * (q.a1 - q.a0), q.b0 + u2 * (q.b1 - q.b0));
+		const glm::vec3 toLight = point - p;
+		const float d2 = dot(toLight, toLight);
+		out.distance = std::sqrt(d2);
+		if (out.distance <= 0.f) return false;
+		out.wi = toLight / out.distance;
+		const float cosLight = std::fabs(out.wi[k]);
+		if (cosLight < 1e-6f) return false;
+		out.pdf = d2 / (cosLight * detail::rectArea(q));
+		u = u1;
+		v = u2;
+	}
+	out.radiance = light.pMat()->emitted(u, v, point);
+	return true;
+}
+
+inline float lights::pdf(const LightPrim& light, const glm::vec3& p, const glm::vec3& wi)
+{
+	const float t = intersect(light, p, wi);
+	if (t < 0.f) return 0.f;
+	if (light.type == PrimitiveType::Sphere)
+	{
+		const float spread = detail::coneSpread(light.sphere, p);
+		return spread < 0.f ? 0.f : 1.f / (2.f * glm::pi<float>() * spread);
+	}
+	int a, b, k;
+	detail::rectAxes(light.type, a, b, k);
+	const float cosLight = std::fabs(wi[k]);
+	return cosLight < 1e-6f ? 0.f : t * t / (cosLight * detail::rectArea(light.rect));
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+#include <iostream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only shared mapping of a whole file. Pages come straight from the page cache,
+// so every process mapping the same file shares one copy.
+class MappedFile
+{
+public:
+	explicit MappedFile(const char* path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool valid() const { return base != nullptr; }
+	const unsigned char* data() const { return static_cast<const unsigned char*>(base); }
+	size_t size() const { return length; }
+private:
+	void* base = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+inline MappedFile::MappedFile(const char* path)
+{
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER fileSize;
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		std::cerr << "ERROR: Could not map file '" << path << "'.\n";
+		return;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping != nullptr) base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (base == nullptr)
+	{
+		std::cerr << "ERROR: Could not map file '" << path << "'.\n";
+		return;
+	}
+	length = static_cast<size_t>(fileSize.QuadPart);
+}
+
+inline MappedFile::~MappedFile()
+{
+	if (base != nullptr) UnmapViewOfFile(base);
+	if (mapping != nullptr) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+#else
+inline MappedFile::MappedFile(const char* path)
+{
+	const int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		std::cerr << "ERROR: Could not map file '" << path << "'.\n";
+		if (fd >= 0) close(fd);
+		return;
+	}
+	void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		std::cerr << "ERROR: Could not map file '" << path << "'.\n";
+		return;
+	}
+	base = p;
+	length = static_cast<size_t>(st.st_size);
+}
+
+inline MappedFile::~MappedFile()
+{
+	if (base != nullptr) munmap(base, length);
+}
+#endif
+
+#endif
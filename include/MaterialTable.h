@@ -0,0 +1,131 @@
+#ifndef MATERIALTABLE_H_
+#define MATERIALTABLE_H_
+
+#include "material.h"
+#include <unordered_map>
+
+// Render-time form of the materials of a scene. Every material is one MaterialRecord in a
+// contiguous array, shaded with a switch on its type, so a hit costs one indexed load instead
+// of a chain of virtual calls through material and texture. Constant textures are folded into
+// the record. Materials without a plain form keep a Virtual record and are called as before,
+// as are hits whose record has no materialId.
+class MaterialTable
+{
+public:
+	static constexpr uint32_t none = hit_record::noMaterial;
+
+	// index of m's record, added the first time m is seen
+	uint32_t add(const material* m);
+	size_t size() const { return records.size(); }
+	const MaterialRecord& record(uint32_t id) const { return records[id]; }
+
+	bool sample(const ray& rIn, const hit_record& rec, ScatterRecord& out) const;
+	vec3 evaluate(const ray& rIn, const hit_record& rec, const vec3& wi) const;
+	float pdf(const ray& rIn, const hit_record& rec, const vec3& wi) const;
+	vec3 emitted(const hit_record& rec) const;
+private:
+	bool compiled(const hit_record& rec) const { return rec.materialId < records.size(); }
+	vec3 color(const MaterialRecord& m, const hit_record& rec) const
+	{
+		return m.texture == MaterialRecord::noTexture ? m.color : textures[m.texture]->filtered(rec.u, rec.v, rec.p, rec.footprint * rec.uvScale);
+	}
+
+	vector<MaterialRecord> records;
+	vector<const material*> sources;	// per record, for Virtual records
+	vector<const texture*> textures;
+	std::unordered_map<const material*, uint32_t> ids;
+	std::unordered_map<const texture*, uint32_t> textureIds;
+};
+
+inline uint32_t MaterialTable::add(const material* m)
+{
+	auto found = ids.find(m);
+	if (found != ids.end()) return found->second;
+
+	MaterialRecord record = { vec3(0.f), 0.f, MaterialRecord::noTexture, MaterialType::Virtual };
+	const texture* tex = nullptr;
+	if (!m || !m->lower(record, tex))
+	{
+		record = { vec3(0.f), 0.f, MaterialRecord::noTexture, MaterialType::Virtual };
+		tex = nullptr;
+	}
+	if (tex && !tex->constant(record.color))
+	{
+		auto inserted = textureIds.emplace(tex, static_cast<uint32_t>(textures.size()));
+		if (inserted.second) textures.push_back(tex);
+		record.texture = inserted.first->second;
+	}
+	const uint32_t id = static_cast<uint32_t>(records.size());
+	records.push_back(record);
+	sources.push_back(m);
+	ids.emplace(m, id);
+	return id;
+}
+
+inline bool MaterialTable::sample(const ray& rIn, const hit_record& rec, ScatterRecord& out) const
+{
+	if (!compiled(rec)) return rec.pMat->sample(rIn, rec, out);
+	const MaterialRecord& m = records[rec.materialId];
+	switch (m.type)
+	{
+	case MaterialType::Lambertian: return bsdf::lambertianSample(color(m, rec), rIn, rec, out);
+	case MaterialType::Metal: return bsdf::mirrorSample(m.color, rIn, rec, out);
+	case MaterialType::FuzzyMetal: return bsdf::phongSample(m.color, m.param, rIn, rec, out);
+	case MaterialType::Dielectric: return bsdf::dielectricSample(m.param, rIn, rec, out);
+	case MaterialType::DiffuseLight: return false;
+	case MaterialType::Isotropic: return bsdf::isotropicSample(color(m, rec), rIn, rec, out);
+	case MaterialType::Virtual: break;
+	}
+	return sources[rec.materialId]->sample(rIn, rec, out);
+}
+
+inline vec3 MaterialTable::evaluate(const ray& rIn, const hit_record& rec, const vec3& wi) const
+{
+	if (!compiled(rec)) return rec.pMat->evaluate(rIn, rec, wi);
+	const MaterialRecord& m = records[rec.materialId];
+	switch (m.type)
+	{
+	case MaterialType::Lambertian:
+	{
+		const float pdf = bsdf::lambertianPdf(rec, wi);
+		return pdf > 0.f ? color(m, rec) * pdf : vec3(0.f);
+	}
+	case MaterialType::FuzzyMetal: return bsdf::phongEvaluate(m.color, m.param, rIn, rec, wi);
+	case MaterialType::Isotropic: return color(m, rec) / (4.f * glm::pi<float>());
+	case MaterialType::Metal:
+	case MaterialType::Dielectric:
+	case MaterialType::DiffuseLight: return vec3(0.f);
+	case MaterialType::Virtual: break;
+	}
+	return sources[rec.materialId]->evaluate(rIn, rec, wi);
+}
+
+inline float MaterialTable::pdf(const ray& rIn, const hit_record& rec, const vec3& wi) const
+{
+	if (!compiled(rec)) return rec.pMat->pdf(rIn, rec, wi);
+	const MaterialRecord& m = records[rec.materialId];
+	switch (m.type)
+	{
+	case MaterialType::Lambertian: return bsdf::lambertianPdf(rec, wi);
+	case MaterialType::FuzzyMetal: return bsdf::phongPdf(m.param, rIn, rec, wi);
+	case MaterialType::Isotropic: return 1.f / (4.f * glm::pi<float>());
+	case MaterialType::Metal:
+	case MaterialType::Dielectric:
+	case MaterialType::DiffuseLight: return 0.f;
+	case MaterialType::Virtual: break;
+	}
+	return sources[rec.materialId]->pdf(rIn, rec, wi);
+}
+
+inline vec3 MaterialTable::emitted(const hit_record& rec) const
+{
+	if (!compiled(rec)) return rec.pMat->emitted(rec.u, rec.v, rec.p);
+	const MaterialRecord& m = records[rec.materialId];
+	// unfiltered like the emission light sampling sees, so the two estimates agree
+	if (m.type == MaterialType::DiffuseLight)
+		return m.texture == MaterialRecord::noTexture ? m.color : textures[m.texture]->value(rec.u, rec.v, rec.p);
+	if (m.type != MaterialType::Virtual) return vec3(0.f);
+	return sources[rec.materialId]->emitted(rec.u, rec.v, rec.p);
+}
+
+#endif
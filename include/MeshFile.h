@@ -0,0 +1,192 @@
+#ifndef MESHFILE_H_
+#define MESHFILE_H_
+
+#include "TriangleMesh.h"
+#include "MappedFile.h"
+#include <cstring>
+#include <fstream>
+
+// Binary mesh format (.rtmesh). A fixed header is followed by sections, each starting on
+// a 64 byte boundary, holding exactly the arrays a MeshView points at. Loading maps the
+// file and points the view into it, nothing is parsed or copied. Little-endian only.
+namespace meshfile
+{
+	constexpr char magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+	constexpr uint32_t version = 1;
+	constexpr uint64_t sectionAlignment = 64;
+
+	enum Section { Positions, Normals, Uvs, Indices, Nodes, Packets, SectionCount };
+
+	struct SectionEntry
+	{
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t vertexCount;
+		uint32_t triangleCount;
+		uint32_t nodeCount;
+		uint32_t packetCount;
+		uint32_t reserved;
+		SectionEntry sections[SectionCount];
+	};
+	static_assert(sizeof(Header) % 8 == 0, "Header is written as is");
+
+	// builds the mesh BVH and writes mesh plus acceleration data to path
+	bool write(const char* path, const MeshData& mesh);
+	// maps path and returns a mesh reading straight from the mapping, or nullptr. Only the
+	// header and the BVH links are checked, so loading touches the nodes but not the geometry;
+	// hit() range checks the triangle it reports. checkRanges also scans every vertex index and
+	// packet triangle, for callers that read the arrays directly.
+	shared_ptr<TriangleMesh> load(const char* path, shared_ptr<material> mat, bool checkRanges = false);
+	// whether every node link of view stays inside its array
+	bool linked(const MeshView& view);
+	// whether every vertex index and packet triangle of view names an existing one
+	bool inRange(const MeshView& view);
+}
+
+inline bool meshfile::write(const char* path, const MeshData& mesh)
+{
+	const auto triangles = static_cast<uint32_t>(mesh.indices.size() / 3);
+	std::vector<FlatBVHNode> nodes;
+	rtnextweek::aligned_vector<TrianglePacket> packets;
+	TriangleMesh::buildAcceleration(mesh.positions.data(), mesh.indices.data(), triangles, nodes, packets);
+
+	Header header = {};
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = version;
+	header.vertexCount = static_cast<uint32_t>(mesh.positions.size());
+	header.triangleCount = triangles;
+	header.nodeCount = static_cast<uint32_t>(nodes.size());
+	header.packetCount = static_cast<uint32_t>(packets.size());
+
+	const bool hasNormals = mesh.normals.size() == mesh.positions.size();
+	const bool hasUvs = mesh.uvs.size() == mesh.positions.size();
+	const void* payload[SectionCount] = {
+		mesh.positions.data(), hasNormals ? mesh.normals.data() : nullptr, hasUvs ? mesh.uvs.data() : nullptr,
+		mesh.indices.data(), nodes.data(), packets.data() };
+	const uint64_t sizes[SectionCount] = {
+		mesh.positions.size() * sizeof(glm::vec3), hasNormals ? mesh.normals.size() * sizeof(glm::vec3) : 0,
+		hasUvs ? mesh.uvs.size() * sizeof(glm::vec2) : 0, uint64_t(triangles) * 3 * sizeof(uint32_t),
+		nodes.size() * sizeof(FlatBVHNode), packets.size() * sizeof(TrianglePacket) };
+
+	uint64_t offset = sizeof(Header);
+	for (int s = 0; s < SectionCount; ++s)
+	{
+		offset = (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+		header.sections[s] = { offset, sizes[s] };
+		offset += sizes[s];
+	}
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		std::cerr << "ERROR: Could not open mesh file '" << path << "' for writing.\n";
+		return false;
+	}
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	uint64_t written = sizeof(header);
+	const char zeros[sectionAlignment] = {};
+	for (int s = 0; s < SectionCount; ++s)
+	{
+		out.write(zeros, static_cast<std::streamsize>(header.sections[s].offset - written));
+		if (sizes[s] > 0) out.write(static_cast<const char*>(payload[s]), static_cast<std::streamsize>(sizes[s]));
+		written = header.sections[s].offset + sizes[s];
+	}
+	return static_cast<bool>(out);
+}
+
+inline shared_ptr<TriangleMesh> meshfile::load(const char* path, shared_ptr<material> mat, bool checkRanges)
+{
+	auto file = make_shared<MappedFile>(path);
+	if (!file->valid()) return nullptr;
+	if (file->size() < sizeof(Header))
+	{
+		std::cerr << "ERROR: '" << path << "' is not a mesh file.\n";
+		return nullptr;
+	}
+	const auto* header = reinterpret_cast<const Header*>(file->data());
+	if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->version != version)
+	{
+		std::cerr << "ERROR: '" << path << "' is not a version " << version << " mesh file.\n";
+		return nullptr;
+	}
+	const uint64_t expected[SectionCount] = {
+		uint64_t(header->vertexCount) * sizeof(glm::vec3), uint64_t(header->vertexCount) * sizeof(glm::vec3),
+		uint64_t(header->vertexCount) * sizeof(glm::vec2), uint64_t(header->triangleCount) * 3 * sizeof(uint32_t),
+		uint64_t(header->nodeCount) * sizeof(FlatBVHNode), uint64_t(header->packetCount) * sizeof(TrianglePacket) };
+	for (int s = 0; s < SectionCount; ++s)
+	{
+		const SectionEntry& e = header->sections[s];
+		const bool optional = s == Normals || s == Uvs;
+		if (e.offset % sectionAlignment != 0 || e.offset > file->size() || e.size > file->size() - e.offset
+			|| (e.size != expected[s] && !(optional && e.size == 0)))
+		{
+			std::cerr << "ERROR: Mesh file '" << path << "' is truncated or corrupt.\n";
+			return nullptr;
+		}
+	}
+
+	auto section = [&](Section s) -> const void*
+	{
+		return header->sections[s].size > 0 ? file->data() + header->sections[s].offset : nullptr;
+	};
+	MeshView view;
+	view.positions = static_cast<const glm::vec3*>(section(Positions));
+	view.normals = static_cast<const glm::vec3*>(section(Normals));
+	view.uvs = static_cast<const glm::vec2*>(section(Uvs));
+	view.indices = static_cast<const uint32_t*>(section(Indices));
+	view.vertexCount = header->vertexCount;
+	view.triangleCount = header->triangleCount;
+	view.nodes = static_cast<const FlatBVHNode*>(section(Nodes));
+	view.nodeCount = header->nodeCount;
+	view.packets = static_cast<const TrianglePacket*>(section(Packets));
+	view.packetCount = header->packetCount;
+	if (!linked(view) || (checkRanges && !inRange(view)))
+	{
+		std::cerr << "ERROR: Mesh file '" << path << "' is truncated or corrupt.\n";
+		return nullptr;
+	}
+	return make_shared<TriangleMesh>(view, std::move(file), std::move(mat));
+}
+
+inline bool meshfile::inRange(const MeshView& view)
+{
+	for (uint64_t i = 0; i < uint64_t(view.triangleCount) * 3; ++i)
+		if (view.indices[i] >= view.vertexCount) return false;
+	for (uint32_t p = 0; p < view.packetCount; ++p)
+		for (uint32_t lane = 0; lane < rtnextweek::simdWidth; ++lane)
+		{
+			const uint32_t tri = view.packets[p].triangle[lane];
+			if (tri >= view.triangleCount && tri != FlatBVH::invalidIndex) return false;
+		}
+	return true;
+}
+
+inline bool meshfile::linked(const MeshView& view)
+{
+	// traversal follows these without bounds checks, children come after their parent so
+	// depths are known by the time a node is reached
+	const uint32_t width = rtnextweek::simdWidth;
+	std::vector<uint8_t> depth(view.nodeCount, 0);
+	for (uint32_t i = 0; i < view.nodeCount; ++i)
+	{
+		const FlatBVHNode& node = view.nodes[i];
+		if (node.count > 0)
+		{
+			// a leaf is the first count lanes of one packet
+			if (node.offset % width != 0 || node.count > width || node.offset / width >= view.packetCount) return false;
+			continue;
+		}
+		if (node.offset <= i + 1 || node.offset >= view.nodeCount || depth[i] + 1 >= FlatBVH::stackSize) return false;
+		depth[i + 1] = std::max<uint8_t>(depth[i + 1], depth[i] + 1);
+		depth[node.offset] = std::max<uint8_t>(depth[node.offset], depth[i] + 1);
+	}
+	return true;
+}
+
+#endif
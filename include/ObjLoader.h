@@ -0,0 +1,133 @@
+#ifndef OBJLOADER_H_
+#define OBJLOADER_H_
+
+#include "TriangleMesh.h"
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+
+// Wavefront OBJ reader for v/vt/vn/f records, polygons are fan triangulated.
+// Meant for offline conversion to the binary mesh format, not for startup loading.
+namespace objloader
+{
+	bool load(const char* path, MeshData& mesh);
+}
+
+inline bool objloader::load(const char* path, MeshData& mesh)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		std::cerr << "ERROR: Could not open OBJ file '" << path << "'.\n";
+		return false;
+	}
+
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> uvs;
+	struct Corner { long v, vt, vn; };
+	struct CornerHash
+	{
+		size_t operator()(const Corner& c) const
+		{
+			return std::hash<long>()(c.v) ^ (std::hash<long>()(c.vt) * 31) ^ (std::hash<long>()(c.vn) * 131);
+		}
+	};
+	struct CornerEqual
+	{
+		bool operator()(const Corner& a, const Corner& b) const { return a.v == b.v && a.vt == b.vt && a.vn == b.vn; }
+	};
+	std::unordered_map<Corner, uint32_t, CornerHash, CornerEqual> vertexOf;
+	std::vector<Corner> corners;
+	std::vector<Corner> face;
+
+	// OBJ indices are 1-based, negative ones count back from the last element
+	auto resolve = [](long index, size_t count) { return index < 0 ? static_cast<long>(count) + index : index - 1; };
+
+	std::string line;
+	size_t lineNumber = 0;
+	while (std::getline(in, line))
+	{
+		++lineNumber;
+		const char* s = line.c_str();
+		while (*s == ' ' || *s == '\t') ++s;
+		char* end;
+		if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+		{
+			const float x = std::strtof(s + 2, &end);
+			const float y = std::strtof(end, &end);
+			const float z = std::strtof(end, &end);
+			positions.emplace_back(x, y, z);
+		}
+		else if (s[0] == 'v' && s[1] == 't')
+		{
+			const float u = std::strtof(s + 2, &end);
+			const float v = std::strtof(end, &end);
+			uvs.emplace_back(u, v);
+		}
+		else if (s[0] == 'v' && s[1] == 'n')
+		{
+			const float x = std::strtof(s + 2, &end);
+			const float y = std::strtof(end, &end);
+			const float z = std::strtof(end, &end);
+			normals.emplace_back(x, y, z);
+		}
+		else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+		{
+			face.clear();
+			const char* p = s + 1;
+			while (true)
+			{
+				while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+				if (*p == '\0') break;
+				Corner c = { std::strtol(p, &end, 10), 0, 0 };
+				if (end == p) break;
+				p = end;
+				if (*p == '/')
+				{
+					if (p[1] != '/') c.vt = std::strtol(p + 1, &end, 10), p = end;
+					else ++p;
+					if (*p == '/') c.vn = std::strtol(p + 1, &end, 10), p = end;
+				}
+				c.v = resolve(c.v, positions.size());
+				c.vt = c.vt != 0 ? resolve(c.vt, uvs.size()) : -1;
+				c.vn = c.vn != 0 ? resolve(c.vn, normals.size()) : -1;
+				if (c.v < 0 || c.v >= static_cast<long>(positions.size()) || c.vt >= static_cast<long>(uvs.size())
+					|| c.vn >= static_cast<long>(normals.size()))
+				{
+					std::cerr << "ERROR: Bad face index in '" << path << "' line " << lineNumber << ".\n";
+					return false;
+				}
+				face.push_back(c);
+			}
+			for (size_t i = 2; i < face.size(); ++i)
+			{
+				for (const Corner& c : { face[0], face[i - 1], face[i] })
+				{
+					auto it = vertexOf.find(c);
+					if (it == vertexOf.end())
+					{
+						it = vertexOf.emplace(c, static_cast<uint32_t>(corners.size())).first;
+						corners.push_back(c);
+					}
+					mesh.indices.push_back(it->second);
+				}
+			}
+		}
+	}
+
+	// every distinct position/uv/normal combination becomes one mesh vertex
+	const bool hasUvs = !uvs.empty();
+	bool hasNormals = !normals.empty();
+	for (const Corner& c : corners) hasNormals = hasNormals && c.vn >= 0;
+	mesh.positions.reserve(corners.size());
+	for (const Corner& c : corners)
+	{
+		mesh.positions.push_back(positions[c.v]);
+		if (hasUvs) mesh.uvs.push_back(c.vt >= 0 ? uvs[c.vt] : glm::vec2(0.f, 0.f));
+		if (hasNormals) mesh.normals.push_back(normals[c.vn]);
+	}
+	return true;
+}
+
+#endif
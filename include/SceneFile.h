@@ -0,0 +1,414 @@
+#ifndef SCENEFILE_H_
+#define SCENEFILE_H_
+
+#include "Json.h"
+#include "Arena.h"
+#include "camera.h"
+#include "material.h"
+#include "texture.h"
+#include "TextureRegistry.h"
+#include "ConstantMedium.h"
+#include "Instance.h"
+#include "MeshFile.h"
+#include "ObjLoader.h"
+#include "ChunkedGeometry.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <glm/gtc/matrix_transform.hpp>
+
+// JSON scene description, so scenes can change without rebuilding the renderer:
+//
+//   { "camera": { "eye": [x,y,z], "center": [x,y,z], "up": [0,1,0], "focal": 1, "width": 2,
+//                 "height": 2, "aperture": 0, "time": [0, 1] },
+//     "background": [r,g,b],
+//     "textures":  { "name": { "type": "solid" | "checker" | "noise" | "image", ... } },
+//     "materials": { "name": { "type": "lambertian" | "metal" | "dielectric" | "light" | "isotropic", ... } },
+//     "objects": [ { "type": "sphere" | "movingSphere" | "xyRect" | "yzRect" | "xzRect" | "box" |
+//                    "plane" | "disk" | "mesh" | "chunks", "material": "name", ...,
+//                    "transform": [ { "translate": [x,y,z] }, { "rotateY": degrees }, ... ],
+//                    "medium": { "density": d, "color": [r,g,b] } } ] }
+//
+// "chunks" names a meshchunks manifest and pages its chunks in on demand within "budgetMB".
+// A top level "textureCacheMB" keeps image textures in the TextureCache within that budget.
+// A noise texture with "bake": resolution samples its turbulence into a NoiseVolume over
+// "bakeMin" to "bakeMax", or over the bounded objects whose material shows it; unbounded ones
+// like planes fade to the exact noise at the faces of the baked box.
+// An object whose material is missing or unknown is warned about and shaded grey lambertian,
+// only objects with a "medium" may leave it out.
+// Colors are [r,g,b] or the name of a texture. Transforms apply in order and collapse into one
+// Instance. Images go through a TextureRegistry, so a file named twice is decoded once. Image
+// decoding and mesh loading, which includes building the BVH of OBJ meshes, run on all cores;
+// everything else is created in the arena on the calling thread.
+namespace scenefile
+{
+	struct Scene
+	{
+		hittable_list world;
+		shared_ptr<camera> cam;
+		vec3 background = vec3(0.f);
+	};
+
+	// reads path into scene, objects live in arena. height defaults to width * aspect.
+	bool load(const char* path, Arena& arena, float aspect, Scene& scene);
+
+	// runs every task once, spread over the hardware threads
+	void runParallel(const std::vector<std::function<void()>>& tasks);
+}
+
+inline void scenefile::runParallel(const std::vector<std::function<void()>>& tasks)
+{
+	const size_t workers = std::min<size_t>(tasks.size(), std::max(1u, std::thread::hardware_concurrency()));
+	if (workers <= 1)
+	{
+		for (const auto& task : tasks) task();
+		return;
+	}
+	std::atomic<size_t> next(0);
+	auto work = [&]()
+	{
+		for (size_t i = next++; i < tasks.size(); i = next++) tasks[i]();
+	};
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < workers; i++) threads.emplace_back(work);
+	work();
+	for (auto& t : threads) t.join();
+}
+
+namespace scenefile
+{
+	namespace detail
+	{
+		class Loader
+		{
+		public:
+			Loader(Arena& arena, const std::string& directory) : arena(arena), directory(directory), images(arena) {}
+			bool load(const json::Value& root, float aspect, Scene& scene);
+		private:
+			struct PendingMesh
+			{
+				std::string file;
+				shared_ptr<material> mat;
+				shared_ptr<hittable> mesh;
+			};
+
+			// a noise texture to bake over explicit bounds or over the objects that use it
+			struct PendingBake
+			{
+				std::string name;
+				NoiseTexture* texture;
+				int resolution;
+				bool fixed;			// bounds given in the file
+				bool bounded;		// bounds known, given or from an object
+				aabb bounds;
+			};
+
+			void warn(const std::string& message) { std::cerr << "scene: " << message << "\n"; }
+			std::string resolve(const std::string& file) const
+			{
+				// relative paths are tried next to the scene file first, then from the working directory
+				if (file.empty() || file[0] == '/' || directory.empty()) return file;
+				const std::string local = directory + file;
+				return std::ifstream(local).good() ? local : file;
+			}
+			static float readNumber(const json::Value& v, const char* key, float fallback)
+			{
+				const json::Value* n = v.find(key);
+				return n && n->isNumber() ? static_cast<float>(n->number) : fallback;
+			}
+			static vec3 readVec3(const json::Value& v, const char* key, const vec3& fallback)
+			{
+				const json::Value* a = v.find(key);
+				if (!a || !a->isArray() || a->array.size() != 3) return fallback;
+				vec3 out;
+				for (int i = 0; i < 3; i++) out[i] = a->array[i].isNumber() ? static_cast<float>(a->array[i].number) : 0.f;
+				return out;
+			}
+			static std::string readString(const json::Value& v, const char* key)
+			{
+				const json::Value* s = v.find(key);
+				return s && s->isString() ? s->string : std::string();
+			}
+
+			shared_ptr<texture> colorOrTexture(const json::Value& v, const char* key, const vec3& fallback);
+			shared_ptr<texture> makeTexture(const std::string& name, const json::Value& v);
+			shared_ptr<material> makeMaterial(const std::string& name, const json::Value& v);
+			// the object without transform or medium, nullptr if it could not be made
+			shared_ptr<hittable> makeShape(const json::Value& v, shared_ptr<material> mat, size_t index);
+			shared_ptr<hittable> wrap(shared_ptr<hittable> object, const json::Value& v);
+
+			Arena& arena;
+			std::string directory;
+			std::unordered_map<std::string, shared_ptr<texture>> textures;
+			std::unordered_map<std::string, shared_ptr<material>> materials;
+			shared_ptr<material> fallbackMaterial;		// for objects without a usable material
+			std::vector<std::function<void()>> tasks;
+			std::vector<PendingMesh> meshes;
+			std::vector<PendingBake> bakes;
+			TextureRegistry images;
+		};
+
+		inline shared_ptr<texture> Loader::colorOrTexture(const json::Value& v, const char* key, const vec3& fallback)
+		{
+			const json::Value* c = v.find(key);
+			if (c && c->isString())
+			{
+				auto found = textures.find(c->string);
+				if (found != textures.end()) return found->second;
+				warn("unknown texture '" + c->string + "'");
+			}
+			return arena.make<solid_color>(readVec3(v, key, fallback));
+		}
+
+		inline shared_ptr<texture> Loader::makeTexture(const std::string& name, const json::Value& v)
+		{
+			const std::string type = readString(v, "type");
+			if (type == "solid") return arena.make<solid_color>(readVec3(v, "color", vec3(0.f)));
+			if (type == "checker")
+				return arena.make<checker_texture>(colorOrTexture(v, "even", vec3(1.f)), colorOrTexture(v, "odd", vec3(0.f)));
+			if (type == "noise")
+			{
+				auto noise = arena.make<NoiseTexture>(readNumber(v, "scale", 1.f));
+				if (const int resolution = static_cast<int>(readNumber(v, "bake", 0.f)); resolution > 1)
+				{
+					const bool fixed = v.find("bakeMin") && v.find("bakeMax");
+					bakes.push_back({ name, noise.get(), resolution, fixed, fixed,
+						aabb(readVec3(v, "bakeMin", vec3(0.f)), readVec3(v, "bakeMax", vec3(0.f))) });
+				}
+				return noise;
+			}
+			// decoded in the background while the meshes load
+			if (type == "image") return images.image(resolve(readString(v, "file")));
+			warn("texture '" + name + "' has unknown type '" + type + "'");
+			return nullptr;
+		}
+
+		inline shared_ptr<material> Loader::makeMaterial(const std::string& name, const json::Value& v)
+		{
+			const std::string type = readString(v, "type");
+			if (type == "lambertian") return arena.make<lambertian>(colorOrTexture(v, "albedo", vec3(.5f)));
+			if (type == "metal")
+			{
+				const vec3 albedo = readVec3(v, "albedo", vec3(.7f));
+				const float fuzz = readNumber(v, "fuzz", 0.f);
+				if (fuzz > 0.f) return arena.make<FuzzyMetal>(albedo, fuzz);
+				return arena.make<metal>(albedo);
+			}
+			if (type == "dielectric") return arena.make<dielectric>(readNumber(v, "ior", 1.5f));
+			if (type == "light") return arena.make<DiffuseLight>(colorOrTexture(v, "emit", vec3(1.f)));
+			if (type == "isotropic") return arena.make<Isotropic>(colorOrTexture(v, "albedo", vec3(1.f)));
+			warn("material '" + name + "' has unknown type '" + type + "'");
+			return nullptr;
+		}
+
+		inline shared_ptr<hittable> Loader::makeShape(const json::Value& v, shared_ptr<material> mat, size_t index)
+		{
+			const std::string type = readString(v, "type");
+			if (type == "sphere")
+				return arena.make<sphere>(readVec3(v, "center", vec3(0.f)), readNumber(v, "radius", 1.f), mat);
+			if (type == "movingSphere")
+				return arena.make<movingsphere>(readVec3(v, "center0", vec3(0.f)), readVec3(v, "center1", vec3(0.f)),
+					readNumber(v, "time0", 0.f), readNumber(v, "time1", 1.f), readNumber(v, "radius", 1.f), mat);
+			if (type == "xyRect")
+				return arena.make<XYRect>(readNumber(v, "x0", 0.f), readNumber(v, "x1", 1.f), readNumber(v, "y0", 0.f),
+					readNumber(v, "y1", 1.f), readNumber(v, "k", 0.f), mat);
+			if (type == "yzRect")
+				return arena.make<YZRect>(readNumber(v, "y0", 0.f), readNumber(v, "y1", 1.f), readNumber(v, "z0", 0.f),
+					readNumber(v, "z1", 1.f), readNumber(v, "k", 0.f), mat);
+			if (type == "xzRect")
+				return arena.make<XZRect>(readNumber(v, "x0", 0.f), readNumber(v, "x1", 1.f), readNumber(v, "z0", 0.f),
+					readNumber(v, "z1", 1.f), readNumber(v, "k", 0.f), mat);
+			if (type == "box")
+				return arena.make<Box>(readVec3(v, "min", vec3(0.f)), readVec3(v, "max", vec3(1.f)), mat);
+			if (type == "plane")
+				return arena.make<Plane>(readVec3(v, "point", vec3(0.f)), readVec3(v, "normal", vec3(0, 1, 0)), mat);
+			if (type == "disk")
+				return arena.make<Disk>(readVec3(v, "center", vec3(0.f)), readVec3(v, "normal", vec3(0, 1, 0)),
+					readNumber(v, "radius", 1.f), mat);
+			if (type == "chunks")
+			{
+				const auto budget = static_cast<uint64_t>(readNumber(v, "budgetMB", 1024.f)) << 20;
+				return ChunkedGeometry::load(resolve(readString(v, "manifest")).c_str(), mat, budget);
+			}
+			if (type == "mesh")
+			{
+				// a placeholder slot, filled by a load task before the transforms are applied
+				meshes[index] = { resolve(readString(v, "file")), mat, nullptr };
+				PendingMesh* pending = &meshes[index];
+				tasks.push_back([pending]()
+				{
+					const std::string& file = pending->file;
+					if (file.size() > 4 && file.compare(file.size() - 4, 4, ".obj") == 0)
+					{
+						MeshData data;
+						if (objloader::load(file.c_str(), data))
+							pending->mesh = make_shared<TriangleMesh>(std::move(data), pending->mat);
+					}
+					else pending->mesh = meshfile::load(file.c_str(), pending->mat);
+				});
+				return nullptr;
+			}
+			warn("object " + std::to_string(index) + " has unknown type '" + type + "'");
+			return nullptr;
+		}
+
+		inline shared_ptr<hittable> Loader::wrap(shared_ptr<hittable> object, const json::Value& v)
+		{
+			const json::Value* steps = v.find("transform");
+			if (steps && steps->isArray() && !steps->array.empty())
+			{
+				glm::mat4 objectToWorld(1.f);
+				for (const json::Value& step : steps->array)
+				{
+					// later steps act on the result of earlier ones, so they multiply from the left
+					glm::mat4 m(1.f);
+					if (step.find("translate")) m = glm::translate(m, readVec3(step, "translate", vec3(0.f)));
+					else if (step.find("rotateX")) m = glm::rotate(m, glm::radians(readNumber(step, "rotateX", 0.f)), vec3(1, 0, 0));
+					else if (step.find("rotateY")) m = glm::rotate(m, glm::radians(readNumber(step, "rotateY", 0.f)), vec3(0, 1, 0));
+					else if (step.find("rotateZ")) m = glm::rotate(m, glm::radians(readNumber(step, "rotateZ", 0.f)), vec3(0, 0, 1));
+					else if (const json::Value* s = step.find("scale"))
+						m = glm::scale(m, s->isNumber() ? vec3(static_cast<float>(s->number)) : readVec3(step, "scale", vec3(1.f)));
+					else warn("unknown transform step");
+					objectToWorld = m * objectToWorld;
+				}
+				object = arena.make<Instance>(object, objectToWorld);
+			}
+			if (const json::Value* medium = v.find("medium"))
+			{
+				const float density = readNumber(*medium, "density", 1.f);
+				auto phase = arena.make<Isotropic>(colorOrTexture(*medium, "color", vec3(1.f)));
+				object = arena.make<ConstantMedium>(object, phase, -1.f / density);
+			}
+			return object;
+		}
+
+		inline bool Loader::load(const json::Value& root, float aspect, Scene& scene)
+		{
+			if (root.find("textureCacheMB"))
+				TextureCache::global().setBudget(static_cast<uint64_t>(std::max(readNumber(root, "textureCacheMB", 0.f), 0.f) * 1024.f * 1024.f));
+			if (const json::Value* list = root.find("textures"))
+				for (const auto& t : list->members)
+					if (auto tex = makeTexture(t.first, t.second)) textures[t.first] = tex;
+			if (const json::Value* list = root.find("materials"))
+				for (const auto& m : list->members)
+					if (auto mat = makeMaterial(m.first, m.second)) materials[m.first] = mat;
+
+			const json::Value* objects = root.find("objects");
+			const size_t count = objects && objects->isArray() ? objects->array.size() : 0;
+			std::vector<shared_ptr<hittable>> shapes(count);
+			std::vector<shared_ptr<material>> objectMaterials(count);
+			meshes.resize(count);
+			for (size_t i = 0; i < count; i++)
+			{
+				const json::Value& v = objects->array[i];
+				shared_ptr<material> mat;
+				const std::string matName = readString(v, "material");
+				auto found = materials.find(matName);
+				if (found != materials.end()) mat = found->second;
+				else if (!matName.empty()) warn("unknown material '" + matName + "', using grey lambertian");
+				// a medium scatters through its own phase function, anything else shades through mat
+				if (!mat && !v.find("medium"))
+				{
+					if (matName.empty()) warn("object " + std::to_string(i) + " has no material, using grey lambertian");
+					if (!fallbackMaterial) fallbackMaterial = arena.make<lambertian>(vec3(.5f));
+					mat = fallbackMaterial;
+				}
+				shapes[i] = makeShape(v, mat, i);
+				objectMaterials[i] = mat;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			runParallel(tasks);
+			images.wait();
+			if (!tasks.empty() || images.requested() > 0)
+				std::cout << "decoded images and meshes in "
+					<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms\n";
+
+			for (size_t i = 0; i < count; i++)
+			{
+				shared_ptr<hittable> object = shapes[i] ? shapes[i] : meshes[i].mesh;
+				if (!object)
+				{
+					if (!meshes[i].file.empty()) warn("could not load mesh '" + meshes[i].file + "'");
+					continue;
+				}
+				object = wrap(object, objects->array[i]);
+				scene.world.add(object);
+				// bake bounds default to the boxes of the objects whose material shows the noise
+				MaterialRecord record;
+				const texture* shown = nullptr;
+				aabb box;
+				if (bakes.empty() || !objectMaterials[i] || !objectMaterials[i]->lower(record, shown) || !object->boundingBox(0.f, 1.f, box)) continue;
+				for (PendingBake& bake : bakes)
+					if (bake.texture == shown && !bake.fixed)
+					{
+						bake.bounds = bake.bounded ? surrounding_box(bake.bounds, box) : box;
+						bake.bounded = true;
+					}
+			}
+			for (const PendingBake& bake : bakes)
+			{
+				if (!bake.bounded)
+				{
+					warn("noise texture '" + bake.name + "' is not shown by a bounded object and has no bakeMin and bakeMax, it is not baked");
+					continue;
+				}
+				const auto bakeStart = std::chrono::steady_clock::now();
+				const NoiseVolume::Stats& stats = bake.texture->bake(bake.bounds, bake.resolution).stats();
+				std::cout << "baked noise '" << bake.name << "' " << stats.dims[0] << "x" << stats.dims[1] << "x" << stats.dims[2] << " in "
+					<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bakeStart).count() << "ms, "
+					<< stats.bytes / (1024. * 1024.) << "MB, turbulence error rms " << stats.rmsError << " max " << stats.maxError << "\n";
+			}
+
+			scene.background = readVec3(root, "background", vec3(0.f));
+			const json::Value noCamera;
+			const json::Value* c = root.find("camera");
+			if (!c) c = &noCamera;
+			const vec3 eye = readVec3(*c, "eye", vec3(0, 0, 1));
+			const vec3 center = readVec3(*c, "center", vec3(0.f));
+			const vec3 up = readVec3(*c, "up", vec3(0, 1, 0));
+			const float focal = readNumber(*c, "focal", 1.f);
+			const float width = readNumber(*c, "width", 2.f);
+			const float height = readNumber(*c, "height", width * aspect);
+			float time[2] = { 0.f, 1.f };
+			if (const json::Value* t = c->find("time"))
+				for (size_t i = 0; i < 2 && t->isArray() && i < t->array.size(); i++)
+					time[i] = static_cast<float>(t->array[i].number);
+			const float aperture = readNumber(*c, "aperture", 0.f);
+			if (aperture > 0.f) scene.cam = make_shared<blurcamera>(eye, center, up, focal, width, height, aperture, time[0], time[1]);
+			else scene.cam = make_shared<camera>(eye, center, up, focal, width, height, time[0], time[1]);
+			return true;
+		}
+	}
+}
+
+inline bool scenefile::load(const char* path, Arena& arena, float aspect, Scene& scene)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "ERROR: could not open scene file '" << path << "'\n";
+		return false;
+	}
+	std::stringstream buffer;
+	buffer << in.rdbuf();
+
+	json::Value root;
+	std::string error;
+	if (!json::parse(buffer.str(), root, error) || !root.isObject())
+	{
+		std::cerr << "ERROR: scene file '" << path << "': " << (error.empty() ? "not an object" : error) << "\n";
+		return false;
+	}
+	const std::string file(path);
+	const size_t slash = file.find_last_of("/\\");
+	detail::Loader loader(arena, slash == std::string::npos ? std::string() : file.substr(0, slash + 1));
+	return loader.load(root, aspect, scene);
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef SPHERESET_H_
+#define SPHERESET_H_
+
+#include "hittable.h"
+#include "flatbvh.h"
+#include "simd.h"
+#include <unordered_map>
+
+// Static spheres stored as structure-of-arrays. The set builds its own BVH whose leaves are
+// clusters of up to simdWidth spheres laid out contiguously, so one leaf is one packet test.
+class SphereSet : public hittable
+{
+public:
+	static constexpr uint32_t clusterSize = rtnextweek::simdWidth;
+
+	SphereSet() = default;
+	void add(const glm::vec3& center, float radius, shared_ptr<material> mat);
+	// lays the spheres out in cluster order, must be called before the set is hit
+	void build();
+	size_t size() const { return count; }
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+	void collectLights(vector<LightPrim>& out) const override;
+private:
+	// closest sphere of the cluster starting at first, or -1, shrinking tMax on a hit
+	int hitCluster(const ray& r, uint32_t first, uint32_t n, float tMin, float& tMax) const;
+	uint32_t materialIndex(const shared_ptr<material>& mat);
+
+	size_t count = 0;
+	std::vector<glm::vec4> pending;		// center and radius of spheres added since the last build
+	std::vector<uint32_t> pendingMat;
+	rtnextweek::aligned_vector<float> centerX, centerY, centerZ, radius;
+	std::vector<uint32_t> matId;
+	std::vector<shared_ptr<material>> materials;
+	std::unordered_map<const material*, uint32_t> materialLookup;
+	std::vector<FlatBVHNode> nodes;
+	aabb box;
+};
+
+inline uint32_t SphereSet::materialIndex(const shared_ptr<material>& mat)
+{
+	auto it = materialLookup.find(mat.get());
+	if (it != materialLookup.end()) return it->second;
+	const auto index = static_cast<uint32_t>(materials.size());
+	materials.push_back(mat);
+	materialLookup.emplace(mat.get(), index);
+	return index;
+}
+
+inline void SphereSet::add(const glm::vec3& center, float r, shared_ptr<material> mat)
+{
+	pending.emplace_back(center, r);
+	pendingMat.push_back(materialIndex(mat));
+}
+
+inline void SphereSet::build()
+{
+	// fold an earlier build back in so spheres can be added in several rounds
+	for (uint32_t slot = 0; slot < centerX.size(); ++slot)
+	{
+		if (std::isnan(centerX[slot])) continue;
+		pending.emplace_back(centerX[slot], centerY[slot], centerZ[slot], radius[slot]);
+		pendingMat.push_back(matId[slot]);
+	}
+	count = pending.size();
+
+	std::vector<aabb> bounds;
+	bounds.reserve(count);
+	for (const auto& s : pending)
+	{
+		const glm::vec3 c(s.x, s.y, s.z);
+		bounds.emplace_back(c - glm::vec3(s.w), c + glm::vec3(s.w));
+	}
+	FlatBVH bvh;
+	bvh.build(std::move(bounds), clusterSize, clusterSize);
+	nodes = bvh.nodes();
+	box = bvh.bounds();
+
+	// unused lanes get a NaN center so the packet test never reports them
+	const auto& order = bvh.order();
+	const uint32_t slots = rtnextweek::roundUp(static_cast<uint32_t>(order.size()), clusterSize);
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	centerX.assign(slots, nan);
+	centerY.assign(slots, nan);
+	centerZ.assign(slots, nan);
+	radius.assign(slots, 0.f);
+	matId.assign(slots, 0);
+	for (uint32_t slot = 0; slot < order.size(); ++slot)
+	{
+		if (order[slot] == FlatBVH::invalidIndex) continue;
+		const glm::vec4& s = pending[order[slot]];
+		centerX[slot] = s.x;
+		centerY[slot] = s.y;
+		centerZ[slot] = s.z;
+		radius[slot] = s.w;
+		matId[slot] = pendingMat[order[slot]];
+	}
+	std::vector<glm::vec4>().swap(pending);
+	std::vector<uint32_t>().swap(pendingMat);
+}
+
+inline int SphereSet::hitCluster(const ray& r, uint32_t first, uint32_t n, float tMin, float& tMax) const
+{
+	const glm::vec3 o = r.origin();
+	const glm::vec3 d = r.direction();
+	const float a = glm::dot(d, d);
+	const float invA = 1.f / a;
+#if RTNW_AVX2
+	const __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(o.x), _mm256_load_ps(&centerX[first]));
+	const __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(o.y), _mm256_load_ps(&centerY[first]));
+	const __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(o.z), _mm256_load_ps(&centerZ[first]));
+	const __m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+	const __m256 rad = _mm256_load_ps(&radius[first]);
+	const __m256 halfB = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+
+	// a * (r^2 - |oc - (halfB / a) d|^2) equals halfB^2 - a * c without the cancellation on large spheres
+	const __m256 s = _mm256_mul_ps(halfB, _mm256_set1_ps(invA));
+	const __m256 fx = _mm256_sub_ps(ocx, _mm256_mul_ps(s, dx));
+	const __m256 fy = _mm256_sub_ps(ocy, _mm256_mul_ps(s, dy));
+	const __m256 fz = _mm256_sub_ps(ocz, _mm256_mul_ps(s, dz));
+	const __m256 f2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy)), _mm256_mul_ps(fz, fz));
+	const __m256 disc = _mm256_mul_ps(_mm256_set1_ps(a), _mm256_sub_ps(_mm256_mul_ps(rad, rad), f2));
+	__m256 valid = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+
+	const __m256 sqrtd = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+	const __m256 vInvA = _mm256_set1_ps(invA);
+	const __m256 vMin = _mm256_set1_ps(tMin), vMax = _mm256_set1_ps(tMax);
+	const __m256 tNear = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), halfB), sqrtd), vInvA);
+	const __m256 tFar = _mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_setzero_ps(), halfB), sqrtd), vInvA);
+	const __m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(tNear, vMin, _CMP_GE_OQ), _mm256_cmp_ps(tNear, vMax, _CMP_LE_OQ));
+	const __m256 t = _mm256_blendv_ps(tFar, tNear, nearOk);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, vMin, _CMP_GE_OQ), _mm256_cmp_ps(t, vMax, _CMP_LE_OQ)));
+
+	float tHit;
+	const int lane = rtnextweek::minLane(t, valid, tHit);
+	if (lane < 0) return -1;
+	tMax = tHit;
+	return static_cast<int>(first) + lane;
+#else
+	int best = -1;
+	for (uint32_t i = first; i < first + n; ++i)
+	{
+		const glm::vec3 oc = o - glm::vec3(centerX[i], centerY[i], centerZ[i]);
+		const float halfB = glm::dot(oc, d);
+		const glm::vec3 f = oc - (halfB * invA) * d;
+		const float disc = a * (radius[i] * radius[i] - glm::dot(f, f));
+		if (!(disc >= 0.f)) continue;
+		const float sqrtd = std::sqrt(disc);
+		float root = (-halfB - sqrtd) * invA;
+		if (root < tMin || tMax < root)
+		{
+			root = (-halfB + sqrtd) * invA;
+			if (root < tMin || tMax < root) continue;
+		}
+		tMax = root;
+		best = static_cast<int>(i);
+	}
+	return best;
+#endif
+}
+
+inline bool SphereSet::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	int slot = -1;
+	float closest = static_cast<float>(t_max);
+	const float tMin = static_cast<float>(t_min);
+	FlatBVH::traverse(nodes.empty() ? nullptr : nodes.data(), r, tMin, closest, [&](uint32_t first, uint32_t n, float& tMax)
+	{
+		const int s = hitCluster(r, first, n, tMin, tMax);
+		if (s < 0) return false;
+		slot = s;
+		closest = tMax;
+		return true;
+	});
+	if (slot < 0) return false;
+
+	const glm::vec3 center(centerX[slot], centerY[slot], centerZ[slot]);
+	rec.t = closest;
+	rec.p = r.at(closest);
+	glm::vec3 outward_normal = (rec.p - center) / radius[slot];
+	rec.set_face_normal(r, outward_normal);
+	sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+	rec.uvScale = sphere::uv_scale(radius[slot], outward_normal);
+	rec.pMat = materials[matId[slot]].get();
+	return true;
+}
+
+inline bool SphereSet::boundingBox(float t0, float t1, aabb& outBox) const
+{
+	if (nodes.empty()) return false;
+	outBox = box;
+	return true;
+}
+
+inline void SphereSet::collectLights(vector<LightPrim>& out) const
+{
+	for (uint32_t slot = 0; slot < centerX.size(); ++slot)
+	{
+		if (std::isnan(centerX[slot])) continue;
+		const SpherePrim s = { glm::vec3(centerX[slot], centerY[slot], centerZ[slot]), radius[slot], materials[matId[slot]].get() };
+		out.push_back({ PrimitiveType::Sphere, s, {} });
+	}
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef STRESSSCENE_H_
+#define STRESSSCENE_H_
+
+#include "InstanceSet.h"
+#include "material.h"
+#include "Arena.h"
+#include <cmath>
+#include <random>
+
+// Benchmark scene: count copies of a sphere, a box and optionally a mesh scattered over a
+// square grid, each with its own rotation, scale and material. The layout only depends on
+// count and seed so runs are comparable. The set is built and ready to hit.
+inline shared_ptr<InstanceSet> instanceStressSet(Arena& arena, size_t count, shared_ptr<hittable> mesh = nullptr, unsigned seed = 1)
+{
+	auto set = arena.make<InstanceSet>();
+	auto white = arena.make<lambertian>(vec3(.73, .73, .73));
+	std::vector<uint16_t> prototypes = {
+		set->addPrototype(arena.make<sphere>(vec3(0, 1, 0), 1, white)),
+		set->addPrototype(arena.make<Box>(vec3(-1, 0, -1), vec3(1, 2, 1), white)) };
+	if (mesh) prototypes.push_back(set->addPrototype(mesh));
+
+	// every draw is its own statement, argument evaluation order would make the layout compiler dependent
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	auto randomColor = [&]()
+	{
+		glm::vec3 color;
+		for (int c = 0; c < 3; c++) color[c] = unit(rng);
+		return color;
+	};
+	std::vector<uint16_t> palette;
+	for (int i = 0; i < 12; i++)
+		palette.push_back(set->addMaterial(arena.make<lambertian>(randomColor())));
+	for (int i = 0; i < 4; i++)
+	{
+		const glm::vec3 albedo = glm::vec3(.5f) + .5f * randomColor();
+		const float fuzz = .3f * unit(rng);
+		palette.push_back(set->addMaterial(arena.make<FuzzyMetal>(albedo, fuzz)));
+	}
+	palette.push_back(set->addMaterial(arena.make<dielectric>(1.5f)));
+
+	const float spacing = 3.f;
+	const auto side = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(count))));
+	const float half = .5f * spacing * side;
+	for (size_t i = 0; i < count; i++)
+	{
+		const float angle = 2.f * glm::pi<float>() * unit(rng);
+		const float scale = .4f + .6f * unit(rng);
+		const float c = std::cos(angle) * scale, s = std::sin(angle) * scale;
+		glm::mat4 objectToWorld(1.f);
+		objectToWorld[0] = glm::vec4(c, 0.f, -s, 0.f);
+		objectToWorld[1] = glm::vec4(0.f, scale, 0.f, 0.f);
+		objectToWorld[2] = glm::vec4(s, 0.f, c, 0.f);
+		const float jitterX = unit(rng) - .5f;
+		const float jitterZ = unit(rng) - .5f;
+		objectToWorld[3] = glm::vec4(spacing * (i % side) - half + jitterX, 0.f, spacing * (i / side) - half + jitterZ, 1.f);
+		const uint16_t prototype = prototypes[rng() % prototypes.size()];
+		const uint16_t material = palette[rng() % palette.size()];
+		set->add(prototype, objectToWorld, material);
+	}
+	set->build();
+	return set;
+}
+
+#endif
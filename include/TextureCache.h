@@ -0,0 +1,243 @@
+#ifndef TEXTURECACHE_H_
+#define TEXTURECACHE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+// Pages of texture images under one memory budget shared by the whole renderer. Images hand
+// their tiled pages over once; they are written to a spill file and read back into a fixed
+// pool of page slots the first time a lookup needs them. When the pool is full the clock
+// algorithm evicts a page that hasn't been touched since the hand last passed it.
+// Lookups take no lock: every slot carries a sequence number that is odd while the slot is
+// refilled, and a read that saw it change is retried, so only faults serialize.
+class TextureCache
+{
+public:
+	static constexpr int pageTexels = 64;	// a page is pageTexels x pageTexels RGB8 texels
+	static constexpr size_t pageBytes = pageTexels * pageTexels * 3;
+
+	struct Stats
+	{
+		uint64_t faults = 0;
+		uint64_t evictions = 0;
+		uint64_t residentBytes = 0;
+	};
+
+	// the pages of one image, removed from the cache when destroyed
+	class Image
+	{
+	public:
+		Image() = default;
+		~Image();
+		Image(const Image&) = delete;
+		Image& operator=(const Image&) = delete;
+		bool valid() const { return cache != nullptr; }
+	private:
+		friend class TextureCache;
+		TextureCache* cache = nullptr;
+		uint64_t fileOffset = 0;
+		uint32_t pageCount = 0;
+		std::unique_ptr<std::atomic<uint32_t>[]> slotOfPage;	// slot + 1, 0 while not resident
+	};
+
+	static TextureCache& global();
+	~TextureCache();
+
+	// page pool size. 0 turns the cache off and textures keep all their texels resident.
+	// Can only change while no image is in the cache.
+	bool setBudget(uint64_t bytes);
+	bool enabled() const { return slotCount > 0; }
+	// takes a copy of pageCount pages for image, the caller's memory can go afterwards
+	bool add(Image& image, const unsigned char* pages, uint32_t pageCount);
+	// n bytes at offset in one page of image, paged in if needed
+	void read(const Image& image, uint32_t page, size_t offset, unsigned char* out, size_t n) const;
+	Stats stats() const;
+private:
+	struct alignas(64) Slot
+	{
+		std::atomic<uint32_t> sequence{ 0 };
+		std::atomic<bool> referenced{ false };
+		std::atomic<const Image*> owner{ nullptr };
+		std::atomic<uint32_t> page{ 0 };
+	};
+	void fault(const Image& image, uint32_t page) const;
+	uint32_t victim() const;
+	void release(uint32_t slot) const;
+	void remove(Image& image);
+
+	mutable std::mutex mutex;	// faults, adding and removing images, the spill file
+	std::unique_ptr<Slot[]> slots;
+	std::unique_ptr<unsigned char[]> memory;
+	uint32_t slotCount = 0;
+	mutable uint32_t hand = 0;
+	mutable Stats counters;
+	std::FILE* spill = nullptr;
+	uint64_t spillSize = 0;
+	size_t imageCount = 0;
+};
+
+inline TextureCache::Image::~Image()
+{
+	if (cache) cache->remove(*this);
+}
+
+inline TextureCache& TextureCache::global()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+inline TextureCache::~TextureCache()
+{
+	if (spill) std::fclose(spill);
+}
+
+inline bool TextureCache::setBudget(uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (imageCount > 0)
+	{
+		std::cerr << "ERROR: The texture cache budget can't change while textures are loaded.\n";
+		return false;
+	}
+	slotCount = bytes == 0 ? 0 : static_cast<uint32_t>(std::max<uint64_t>(bytes / pageBytes, 1));
+	slots.reset(slotCount ? new Slot[slotCount] : nullptr);
+	memory.reset(slotCount ? new unsigned char[size_t(slotCount) * pageBytes] : nullptr);
+	hand = 0;
+	counters = Stats();
+	return true;
+}
+
+inline bool TextureCache::add(Image& image, const unsigned char* pages, uint32_t pageCount)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!enabled()) return false;
+	if (!spill && !(spill = std::tmpfile()))
+	{
+		std::cerr << "ERROR: Could not create the texture cache spill file.\n";
+		return false;
+	}
+	const size_t bytes = size_t(pageCount) * pageBytes;
+#ifdef _WIN32
+	const bool positioned = _fseeki64(spill, static_cast<__int64>(spillSize), SEEK_SET) == 0;
+#else
+	const bool positioned = fseeko(spill, static_cast<off_t>(spillSize), SEEK_SET) == 0;
+#endif
+	if (!positioned || std::fwrite(pages, 1, bytes, spill) != bytes)
+	{
+		std::cerr << "ERROR: Could not write to the texture cache spill file.\n";
+		return false;
+	}
+	image.cache = this;
+	image.fileOffset = spillSize;
+	image.pageCount = pageCount;
+	image.slotOfPage.reset(new std::atomic<uint32_t>[pageCount]());
+	spillSize += bytes;
+	imageCount++;
+	return true;
+}
+
+inline void TextureCache::read(const Image& image, uint32_t page, size_t offset, unsigned char* out, size_t n) const
+{
+	while (true)
+	{
+		const uint32_t entry = image.slotOfPage[page].load(std::memory_order_acquire);
+		if (entry == 0)
+		{
+			fault(image, page);
+			continue;
+		}
+		Slot& slot = slots[entry - 1];
+		const uint32_t before = slot.sequence.load(std::memory_order_acquire);
+		// a stale entry names a slot that already holds another page, the table is cleared next
+		if ((before & 1) || slot.owner.load(std::memory_order_relaxed) != &image || slot.page.load(std::memory_order_relaxed) != page)
+			continue;
+		std::memcpy(out, memory.get() + size_t(entry - 1) * pageBytes + offset, n);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != before) continue;
+		if (!slot.referenced.load(std::memory_order_relaxed)) slot.referenced.store(true, std::memory_order_relaxed);
+		return;
+	}
+}
+
+inline uint32_t TextureCache::victim() const
+{
+	// free slots first, otherwise the first one not referenced since the last sweep
+	while (true)
+	{
+		const uint32_t slot = hand;
+		hand = (hand + 1) % slotCount;
+		if (!slots[slot].owner.load(std::memory_order_relaxed)) return slot;
+		if (!slots[slot].referenced.exchange(false, std::memory_order_relaxed)) return slot;
+	}
+}
+
+inline void TextureCache::release(uint32_t index) const
+{
+	Slot& slot = slots[index];
+	const Image* owner = slot.owner.load(std::memory_order_relaxed);
+	if (!owner) return;
+	owner->slotOfPage[slot.page.load(std::memory_order_relaxed)].store(0, std::memory_order_release);
+	slot.sequence.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.owner.store(nullptr, std::memory_order_relaxed);
+	slot.sequence.fetch_add(1, std::memory_order_release);
+	counters.residentBytes -= pageBytes;
+}
+
+inline void TextureCache::fault(const Image& image, uint32_t page) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (image.slotOfPage[page].load(std::memory_order_relaxed) != 0) return;	// another thread got it
+	const uint32_t index = victim();
+	if (slots[index].owner.load(std::memory_order_relaxed)) counters.evictions++;
+	release(index);
+
+	// odd sequence while the bytes change, readers that overlap it retry
+	Slot& slot = slots[index];
+	slot.sequence.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	unsigned char* target = memory.get() + size_t(index) * pageBytes;
+	const uint64_t position = image.fileOffset + uint64_t(page) * pageBytes;
+#ifdef _WIN32
+	const bool positioned = _fseeki64(spill, static_cast<__int64>(position), SEEK_SET) == 0;
+#else
+	const bool positioned = fseeko(spill, static_cast<off_t>(position), SEEK_SET) == 0;
+#endif
+	if (!positioned || std::fread(target, 1, pageBytes, spill) != pageBytes)
+	{
+		std::cerr << "ERROR: Could not read a page back from the texture cache spill file.\n";
+		std::memset(target, 0, pageBytes);
+	}
+	slot.owner.store(&image, std::memory_order_relaxed);
+	slot.page.store(page, std::memory_order_relaxed);
+	slot.referenced.store(true, std::memory_order_relaxed);
+	slot.sequence.fetch_add(1, std::memory_order_release);
+	image.slotOfPage[page].store(index + 1, std::memory_order_release);
+	counters.faults++;
+	counters.residentBytes += pageBytes;
+}
+
+inline void TextureCache::remove(Image& image)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (uint32_t i = 0; i < slotCount; i++)
+		if (slots[i].owner.load(std::memory_order_relaxed) == &image) release(i);
+	// the image's part of the spill file is not reused
+	image.cache = nullptr;
+	imageCount--;
+}
+
+inline TextureCache::Stats TextureCache::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return counters;
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef TEXTUREFILE_H_
+#define TEXTUREFILE_H_
+
+#include "texture.h"
+#include "MappedFile.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+// Cache format for image textures (.rttex), written next to the image the first time it is
+// decoded. A fixed header and the mip levels are followed by the tiled RGB8 pages exactly as
+// ImageTexture keeps them, so loading maps the file and looks texels up in the mapping with
+// nothing decoded or copied. The header records the size and hash of the image it was made
+// from; a cache file whose image changed is ignored and rewritten. Little-endian only.
+namespace texturefile
+{
+	constexpr char magic[8] = { 'R', 'T', 'T', 'E', 'X', '\0', '\0', '\0' };
+	constexpr uint32_t version = 1;
+	constexpr uint64_t pageAlignment = 4096;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t levelCount;
+		uint32_t pageCount;
+		uint32_t pageBytes;
+		uint64_t sourceSize;
+		uint64_t sourceHash;
+		uint64_t pagesOffset;
+	};
+	static_assert(sizeof(Header) % 8 == 0, "Header is written as is");
+
+	struct LevelEntry
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t pagesX;
+		uint32_t firstPage;
+	};
+
+	inline std::string cachePath(const std::string& image) { return image + ".rttex"; }
+	// writes the pages of image, made from a file of sourceSize bytes hashing to sourceHash
+	bool write(const char* path, const ImageTexture& image, uint64_t sourceSize, uint64_t sourceHash);
+	// points image at the pages mapped from path. False without a message when there is no
+	// cache file yet or it was made from another version of the image.
+	bool load(const char* path, ImageTexture& image, uint64_t sourceSize, uint64_t sourceHash);
+}
+
+inline bool texturefile::write(const char* path, const ImageTexture& image, uint64_t sourceSize, uint64_t sourceHash)
+{
+	const auto& levels = image.mipLevels();
+	if (levels.empty()) return false;
+	Header header = {};
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = version;
+	header.levelCount = static_cast<uint32_t>(levels.size());
+	header.pageCount = image.pageCount();
+	header.pageBytes = static_cast<uint32_t>(ImageTexture::pageBytes);
+	header.sourceSize = sourceSize;
+	header.sourceHash = sourceHash;
+	const uint64_t levelsEnd = sizeof(Header) + levels.size() * sizeof(LevelEntry);
+	header.pagesOffset = (levelsEnd + pageAlignment - 1) / pageAlignment * pageAlignment;
+
+	// written under another name and renamed, a reader never maps a half written file
+	const std::string temporary = std::string(path) + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		if (!out)
+		{
+			std::cerr << "ERROR: Could not open texture cache file '" << path << "' for writing.\n";
+			return false;
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for (const auto& level : levels)
+		{
+			const LevelEntry entry = { static_cast<uint32_t>(level.width), static_cast<uint32_t>(level.height),
+				static_cast<uint32_t>(level.pagesX), level.firstPage };
+			out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+		}
+		const std::vector<char> zeros(static_cast<size_t>(header.pagesOffset - levelsEnd), 0);
+		out.write(zeros.data(), static_cast<std::streamsize>(zeros.size()));
+		std::vector<unsigned char> page(ImageTexture::pageBytes);
+		for (uint32_t i = 0; i < header.pageCount; i++)
+		{
+			image.readPage(i, page.data());
+			out.write(reinterpret_cast<const char*>(page.data()), static_cast<std::streamsize>(page.size()));
+		}
+		if (!out)
+		{
+			std::cerr << "ERROR: Could not write texture cache file '" << path << "'.\n";
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temporary, path, error);
+	if (error)
+	{
+		std::cerr << "ERROR: Could not write texture cache file '" << path << "'.\n";
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+	return true;
+}
+
+inline bool texturefile::load(const char* path, ImageTexture& image, uint64_t sourceSize, uint64_t sourceHash)
+{
+	std::error_code error;
+	if (!std::filesystem::exists(path, error)) return false;
+	auto file = std::make_shared<MappedFile>(path);
+	if (!file->valid()) return false;
+	const auto* header = reinterpret_cast<const Header*>(file->data());
+	if (file->size() < sizeof(Header) || std::memcmp(header->magic, magic, sizeof(magic)) != 0
+		|| header->version != version || header->pageBytes != ImageTexture::pageBytes)
+	{
+		std::cerr << "ERROR: '" << path << "' is not a version " << version << " texture cache file.\n";
+		return false;
+	}
+	if (header->sourceSize != sourceSize || header->sourceHash != sourceHash) return false;
+
+	// neither count can overflow a product, the offset is compared without adding to it
+	const uint64_t levelsEnd = sizeof(Header) + uint64_t(header->levelCount) * sizeof(LevelEntry);
+	const uint64_t pagesBytes = uint64_t(header->pageCount) * ImageTexture::pageBytes;
+	bool consistent = header->levelCount > 0 && levelsEnd <= header->pagesOffset
+		&& header->pagesOffset % pageAlignment == 0 && header->pagesOffset <= file->size()
+		&& pagesBytes <= file->size() - header->pagesOffset;
+	std::vector<ImageTexture::Level> levels;
+	const auto* entries = reinterpret_cast<const LevelEntry*>(file->data() + sizeof(Header));
+	uint32_t pageCount = 0;
+	for (uint32_t i = 0; consistent && i < header->levelCount; i++)
+	{
+		const LevelEntry& e = entries[i];
+		const uint32_t pagesY = (e.height + ImageTexture::pageSize - 1) / ImageTexture::pageSize;
+		consistent = e.width > 0 && e.height > 0 && e.firstPage == pageCount
+			&& e.pagesX == (e.width + ImageTexture::pageSize - 1) / ImageTexture::pageSize;
+		pageCount += e.pagesX * pagesY;
+		levels.push_back({ static_cast<int>(e.width), static_cast<int>(e.height), static_cast<int>(e.pagesX), e.firstPage });
+	}
+	if (!consistent || pageCount != header->pageCount)
+	{
+		std::cerr << "ERROR: Texture cache file '" << path << "' is damaged.\n";
+		return false;
+	}
+	const unsigned char* pages = file->data() + header->pagesOffset;
+	image.adopt(std::move(levels), pages, std::move(file));
+	return true;
+}
+
+#endif
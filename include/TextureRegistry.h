@@ -0,0 +1,188 @@
+#ifndef TEXTUREREGISTRY_H_
+#define TEXTUREREGISTRY_H_
+
+#include "Arena.h"
+#include "MappedFile.h"
+#include "texture.h"
+#include "TextureFile.h"
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Image textures of a scene, made once per file. A path seen before, or a file with the same
+// bytes as one seen before, gives back the texture already made for it, so a scene that names
+// an image twice decodes and stores it once. Textures are handed out right away and decoded
+// on a pool of worker threads while the caller goes on building the rest of the scene; wait()
+// before rendering with them. The first decode of an image also writes a .rttex cache file next
+// to it, later runs map that instead of decoding.
+class TextureRegistry
+{
+public:
+	// threads 0 uses one worker per hardware thread
+	explicit TextureRegistry(Arena& arena, unsigned threads = 0);
+	~TextureRegistry();
+	TextureRegistry(const TextureRegistry&) = delete;
+	TextureRegistry& operator=(const TextureRegistry&) = delete;
+
+	// the texture for the image at path, decoded in the background
+	shared_ptr<ImageTexture> image(const std::string& path);
+	// blocks until every image asked for so far is decoded
+	void wait();
+	// whether images are read from and written to .rttex cache files, on by default
+	void setFileCache(bool enabled) { fileCache = enabled; }
+	size_t requested() const { return requests; }
+	// images actually decoded, the rest of the requests shared one of them
+	size_t decoded() const { return decodes; }
+private:
+	struct Entry
+	{
+		std::string path;
+		size_t size;
+		shared_ptr<ImageTexture> image;
+	};
+	static uint64_t hash(const unsigned char* data, size_t size);
+	static bool sameBytes(const std::string& path, const MappedFile& file);
+	void enqueue(std::function<void()> job);
+	void work();
+
+	Arena& arena;
+	std::unordered_map<std::string, shared_ptr<ImageTexture>> byPath;
+	std::unordered_map<uint64_t, std::vector<Entry>> byContent;
+	size_t requests = 0;
+	size_t decodes = 0;
+	bool fileCache = true;
+
+	unsigned threadCount;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::deque<std::function<void()>> jobs;
+	size_t pending = 0;		// queued or running
+	bool stopping = false;
+};
+
+inline TextureRegistry::TextureRegistry(Arena& arena, unsigned threads)
+	: arena(arena), threadCount(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+inline TextureRegistry::~TextureRegistry()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	// workers drain the queue before they see stopping, textures are never left half built
+	for (auto& t : workers) t.join();
+}
+
+inline uint64_t TextureRegistry::hash(const unsigned char* data, size_t size)
+{
+	// FNV-1a over 8 byte words, the tail byte by byte
+	uint64_t h = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, data + i, 8);
+		h = (h ^ word) * 1099511628211ull;
+	}
+	for (; i < size; i++) h = (h ^ data[i]) * 1099511628211ull;
+	return h ^ size;
+}
+
+inline bool TextureRegistry::sameBytes(const std::string& path, const MappedFile& file)
+{
+	MappedFile other(path.c_str());
+	return other.valid() && other.size() == file.size() && std::memcmp(other.data(), file.data(), file.size()) == 0;
+}
+
+inline shared_ptr<ImageTexture> TextureRegistry::image(const std::string& path)
+{
+	requests++;
+	std::error_code error;
+	std::string key = std::filesystem::weakly_canonical(path, error).string();
+	if (error || key.empty()) key = path;
+	auto known = byPath.find(key);
+	if (known != byPath.end()) return known->second;
+
+	// mapping and hashing is cheap next to decoding, it runs here so duplicates are known now
+	auto file = std::make_shared<MappedFile>(path.c_str());
+	if (!file->valid())
+	{
+		// stays empty and shows as missing, like an ImageTexture whose file failed to load
+		auto missing = arena.make<ImageTexture>();
+		byPath.emplace(key, missing);
+		return missing;
+	}
+	const uint64_t contentHash = hash(file->data(), file->size());
+	std::vector<Entry>& candidates = byContent[contentHash];
+	for (const Entry& entry : candidates)
+		if (entry.size == file->size() && sameBytes(entry.path, *file))
+		{
+			byPath.emplace(key, entry.image);
+			return entry.image;
+		}
+
+	auto image = arena.make<ImageTexture>();
+	byPath.emplace(key, image);
+	candidates.push_back({ path, file->size(), image });
+	decodes++;
+	ImageTexture* target = image.get();
+	const bool cached = fileCache;
+	enqueue([target, file, path, contentHash, cached]()
+	{
+		const std::string cacheFile = texturefile::cachePath(path);
+		if (cached && texturefile::load(cacheFile.c_str(), *target, file->size(), contentHash)) return;
+		if (!target->load(file->data(), file->size()))
+		{
+			std::cerr << "ERROR: Could not decode texture image file '" << path << "'.\n";
+			return;
+		}
+		if (cached) texturefile::write(cacheFile.c_str(), *target, file->size(), contentHash);
+	});
+	return image;
+}
+
+inline void TextureRegistry::enqueue(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::move(job));
+		pending++;
+		// one more worker per job until the pool is full, small scenes don't start idle threads
+		if (workers.size() < threadCount && workers.size() < pending) workers.emplace_back(&TextureRegistry::work, this);
+	}
+	wake.notify_one();
+}
+
+inline void TextureRegistry::work()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+		if (jobs.empty()) return;
+		std::function<void()> job = std::move(jobs.front());
+		jobs.pop_front();
+		lock.unlock();
+		job();
+		lock.lock();
+		if (--pending == 0) idle.notify_all();
+	}
+}
+
+inline void TextureRegistry::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this]() { return pending == 0; });
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef TRIANGLEMESH_H_
+#define TRIANGLEMESH_H_
+
+#include "hittable.h"
+#include "flatbvh.h"
+#include "simd.h"
+
+// Leaf of a mesh BVH: up to simdWidth triangles with their vertex positions transposed so
+// a packet is intersected with one set of vector loads. Unused lanes hold NaN positions.
+struct TrianglePacket
+{
+	float v[3][3][rtnextweek::simdWidth];	// [vertex][axis][lane]
+	uint32_t triangle[rtnextweek::simdWidth];
+};
+static_assert(sizeof(TrianglePacket) == 320, "TrianglePacket is written to disk as is");
+
+// Mesh buffers as produced by a loader, indices are three per triangle.
+// normals and uvs are optional and indexed like positions.
+struct MeshData
+{
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<uint32_t> indices;
+};
+
+// Non-owning view of a mesh and its acceleration data, wherever the memory lives.
+struct MeshView
+{
+	const glm::vec3* positions = nullptr;
+	const glm::vec3* normals = nullptr;
+	const glm::vec2* uvs = nullptr;
+	const uint32_t* indices = nullptr;
+	uint32_t vertexCount = 0;
+	uint32_t triangleCount = 0;
+	const FlatBVHNode* nodes = nullptr;
+	uint32_t nodeCount = 0;
+	const TrianglePacket* packets = nullptr;
+	uint32_t packetCount = 0;
+};
+
+class TriangleMesh : public hittable
+{
+public:
+	// takes the buffers over and builds the mesh BVH
+	TriangleMesh(MeshData data, shared_ptr<material> mat);
+	// uses prebuilt buffers, storage keeps the memory behind the view alive
+	TriangleMesh(const MeshView& view, shared_ptr<const void> storage, shared_ptr<material> mat);
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+	const MeshView& view() const { return mesh; }
+	size_t triangleCount() const { return mesh.triangleCount; }
+
+	static void buildAcceleration(const glm::vec3* positions, const uint32_t* indices, uint32_t triangleCount,
+		std::vector<FlatBVHNode>& nodes, rtnextweek::aligned_vector<TrianglePacket>& packets);
+private:
+	// ray set up for the watertight test of Woop et al.: the ray is sheared onto +z once per hit call
+	struct ShearedRay
+	{
+		glm::vec3 origin;
+		int kx, ky, kz;
+		float sx, sy, sz;
+	};
+	static ShearedRay shear(const ray& r);
+	// closest lane of the packet or -1, shrinking tMax and returning the barycentrics of vertices 1 and 2
+	static int hitPacket(const ShearedRay& sr, const TrianglePacket& packet, uint32_t n,
+		float tMin, float& tMax, float& b1, float& b2);
+
+	struct Storage
+	{
+		MeshData data;
+		std::vector<FlatBVHNode> nodes;
+		rtnextweek::aligned_vector<TrianglePacket> packets;
+	};
+	MeshView mesh;
+	shared_ptr<const void> storage;
+	shared_ptr<material> pMat;
+	aabb box;
+};
+
+inline void TriangleMesh::buildAcceleration(const glm::vec3* positions, const uint32_t* indices, uint32_t triangleCount,
+	std::vector<FlatBVHNode>& nodes, rtnextweek::aligned_vector<TrianglePacket>& packets)
+{
+	const uint32_t width = rtnextweek::simdWidth;
+	std::vector<aabb> bounds(triangleCount);
+	for (uint32_t i = 0; i < triangleCount; ++i)
+	{
+		const glm::vec3& p0 = positions[indices[3 * i]];
+		const glm::vec3& p1 = positions[indices[3 * i + 1]];
+		const glm::vec3& p2 = positions[indices[3 * i + 2]];
+		bounds[i] = aabb(glm::min(p0, glm::min(p1, p2)), glm::max(p0, glm::max(p1, p2)));
+	}
+	FlatBVH bvh;
+	bvh.build(std::move(bounds), width, width);
+	nodes = bvh.nodes();
+
+	const auto& order = bvh.order();
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	packets.resize(rtnextweek::roundUp(static_cast<uint32_t>(order.size()), width) / width);
+	for (uint32_t slot = 0; slot < packets.size() * width; ++slot)
+	{
+		TrianglePacket& packet = packets[slot / width];
+		const uint32_t lane = slot % width;
+		const uint32_t tri = slot < order.size() ? order[slot] : FlatBVH::invalidIndex;
+		packet.triangle[lane] = tri;
+		for (int vtx = 0; vtx < 3; ++vtx)
+		{
+			const glm::vec3 p = tri == FlatBVH::invalidIndex ? glm::vec3(nan) : positions[indices[3 * tri + vtx]];
+			for (int axis = 0; axis < 3; ++axis)
+				packet.v[vtx][axis][lane] = p[axis];
+		}
+	}
+}
+
+inline TriangleMesh::TriangleMesh(MeshData data, shared_ptr<material> mat) : pMat(std::move(mat))
+{
+	auto owned = make_shared<Storage>();
+	owned->data = std::move(data);
+	const MeshData& d = owned->data;
+	const auto triangles = static_cast<uint32_t>(d.indices.size() / 3);
+	buildAcceleration(d.positions.data(), d.indices.data(), triangles, owned->nodes, owned->packets);
+
+	mesh.positions = d.positions.data();
+	mesh.normals = d.normals.size() == d.positions.size() ? d.normals.data() : nullptr;
+	mesh.uvs = d.uvs.size() == d.positions.size() ? d.uvs.data() : nullptr;
+	mesh.indices = d.indices.data();
+	mesh.vertexCount = static_cast<uint32_t>(d.positions.size());
+	mesh.triangleCount = triangles;
+	mesh.nodes = owned->nodes.empty() ? nullptr : owned->nodes.data();
+	mesh.nodeCount = static_cast<uint32_t>(owned->nodes.size());
+	mesh.packets = owned->packets.data();
+	mesh.packetCount = static_cast<uint32_t>(owned->packets.size());
+	if (mesh.nodeCount > 0) box = aabb(mesh.nodes[0].boxMin, mesh.nodes[0].boxMax);
+	storage = std::move(owned);
+}
+
+inline TriangleMesh::TriangleMesh(const MeshView& view, shared_ptr<const void> s, shared_ptr<material> mat)
+	: mesh(view), storage(std::move(s)), pMat(std::move(mat))
+{
+	if (mesh.nodeCount > 0) box = aabb(mesh.nodes[0].boxMin, mesh.nodes[0].boxMax);
+}
+
+inline TriangleMesh::ShearedRay TriangleMesh::shear(const ray& r)
+{
+	ShearedRay sr;
+	const glm::vec3 d = r.direction();
+	sr.origin = r.origin();
+	sr.kz = 0;
+	if (std::abs(d.y) > std::abs(d[sr.kz])) sr.kz = 1;
+	if (std::abs(d.z) > std::abs(d[sr.kz])) sr.kz = 2;
+	sr.kx = (sr.kz + 1) % 3;
+	sr.ky = (sr.kx + 1) % 3;
+	// keep the winding of the triangles when the dominant axis points backwards
+	if (d[sr.kz] < 0.f) std::swap(sr.kx, sr.ky);
+	sr.sx = d[sr.kx] / d[sr.kz];
+	sr.sy = d[sr.ky] / d[sr.kz];
+	sr.sz = 1.f / d[sr.kz];
+	return sr;
+}
+
+inline int TriangleMesh::hitPacket(const ShearedRay& sr, const TrianglePacket& packet, uint32_t n,
+	float tMin, float& tMax, float& b1, float& b2)
+{
+#if RTNW_AVX2
+	const __m256 sx = _mm256_set1_ps(sr.sx), sy = _mm256_set1_ps(sr.sy), sz = _mm256_set1_ps(sr.sz);
+	__m256 x[3], y[3], z[3];
+	for (int vtx = 0; vtx < 3; ++vtx)
+	{
+		const __m256 px = _mm256_sub_ps(_mm256_load_ps(packet.v[vtx][sr.kx]), _mm256_set1_ps(sr.origin[sr.kx]));
+		const __m256 py = _mm256_sub_ps(_mm256_load_ps(packet.v[vtx][sr.ky]), _mm256_set1_ps(sr.origin[sr.ky]));
+		const __m256 pz = _mm256_sub_ps(_mm256_load_ps(packet.v[vtx][sr.kz]), _mm256_set1_ps(sr.origin[sr.kz]));
+		x[vtx] = _mm256_sub_ps(px, _mm256_mul_ps(sx, pz));
+		y[vtx] = _mm256_sub_ps(py, _mm256_mul_ps(sy, pz));
+		z[vtx] = _mm256_mul_ps(sz, pz);
+	}
+	// scaled barycentrics as edge functions of the sheared 2D triangle
+	const __m256 u = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+	const __m256 v = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+	const __m256 w = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 anyNeg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)), _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+	const __m256 anyPos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+	const __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+	__m256 valid = _mm256_andnot_ps(_mm256_and_ps(anyNeg, anyPos), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+
+	const __m256 scaledT = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, z[0]), _mm256_mul_ps(v, z[1])), _mm256_mul_ps(w, z[2]));
+	const __m256 t = _mm256_div_ps(scaledT, det);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(tMin), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LE_OQ)));
+
+	float tHit;
+	const int lane = rtnextweek::minLane(t, valid, tHit);
+	if (lane < 0) return -1;
+	alignas(32) float vs[rtnextweek::simdWidth], ws[rtnextweek::simdWidth], dets[rtnextweek::simdWidth];
+	_mm256_store_ps(vs, v);
+	_mm256_store_ps(ws, w);
+	_mm256_store_ps(dets, det);
+	tMax = tHit;
+	b1 = vs[lane] / dets[lane];
+	b2 = ws[lane] / dets[lane];
+	return lane;
+#else
+	int best = -1;
+	for (uint32_t lane = 0; lane < n; ++lane)
+	{
+		float x[3], y[3], z[3];
+		for (int vtx = 0; vtx < 3; ++vtx)
+		{
+			const float px = packet.v[vtx][sr.kx][lane] - sr.origin[sr.kx];
+			const float py = packet.v[vtx][sr.ky][lane] - sr.origin[sr.ky];
+			const float pz = packet.v[vtx][sr.kz][lane] - sr.origin[sr.kz];
+			x[vtx] = px - sr.sx * pz;
+			y[vtx] = py - sr.sy * pz;
+			z[vtx] = sr.sz * pz;
+		}
+		float u = x[2] * y[1] - y[2] * x[1];
+		float v = x[0] * y[2] - y[0] * x[2];
+		float w = x[1] * y[0] - y[1] * x[0];
+		// an edge passing exactly through the ray is decided in double precision
+		if (u == 0.f || v == 0.f || w == 0.f)
+		{
+			u = static_cast<float>(static_cast<double>(x[2]) * y[1] - static_cast<double>(y[2]) * x[1]);
+			v = static_cast<float>(static_cast<double>(x[0]) * y[2] - static_cast<double>(y[0]) * x[2]);
+			w = static_cast<float>(static_cast<double>(x[1]) * y[0] - static_cast<double>(y[1]) * x[0]);
+		}
+		if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f)) continue;
+		const float det = u + v + w;
+		if (det == 0.f) continue;
+		const float t = (u * z[0] + v * z[1] + w * z[2]) / det;
+		if (!(t >= tMin && t <= tMax)) continue;
+		tMax = t;
+		b1 = v / det;
+		b2 = w / det;
+		best = static_cast<int>(lane);
+	}
+	return best;
+#endif
+}
+
+inline bool TriangleMesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	const ShearedRay sr = shear(r);
+	const float tMin = static_cast<float>(t_min);
+	float closest = static_cast<float>(t_max);
+	uint32_t tri = FlatBVH::invalidIndex;
+	float b1 = 0.f, b2 = 0.f;
+	FlatBVH::traverse(mesh.nodes, r, tMin, closest, [&](uint32_t first, uint32_t n, float& tMax)
+	{
+		const TrianglePacket& packet = mesh.packets[first / rtnextweek::simdWidth];
+		const int lane = hitPacket(sr, packet, n, tMin, tMax, b1, b2);
+		if (lane < 0) return false;
+		tri = packet.triangle[lane];
+		closest = tMax;
+		return true;
+	});
+	// mapped files only have their BVH links checked at load, a damaged triangle is a miss
+	if (tri >= mesh.triangleCount) return false;
+
+	const uint32_t i0 = mesh.indices[3 * tri], i1 = mesh.indices[3 * tri + 1], i2 = mesh.indices[3 * tri + 2];
+	if (i0 >= mesh.vertexCount || i1 >= mesh.vertexCount || i2 >= mesh.vertexCount) return false;
+	const float b0 = 1.f - b1 - b2;
+	rec.t = closest;
+	rec.p = r.at(closest);
+	glm::vec3 outward_normal = mesh.normals
+		? b0 * mesh.normals[i0] + b1 * mesh.normals[i1] + b2 * mesh.normals[i2]
+		: glm::cross(mesh.positions[i1] - mesh.positions[i0], mesh.positions[i2] - mesh.positions[i0]);
+	rec.set_face_normal(r, glm::normalize(outward_normal));
+	// uv area over surface area of the triangle, barycentrics span half the unit square
+	const float area = glm::length(glm::cross(mesh.positions[i1] - mesh.positions[i0], mesh.positions[i2] - mesh.positions[i0]));
+	float uvArea = 1.f;
+	if (mesh.uvs)
+	{
+		const glm::vec2 uv = b0 * mesh.uvs[i0] + b1 * mesh.uvs[i1] + b2 * mesh.uvs[i2];
+		rec.u = uv.x;
+		rec.v = uv.y;
+		const glm::vec2 e1 = mesh.uvs[i1] - mesh.uvs[i0], e2 = mesh.uvs[i2] - mesh.uvs[i0];
+		uvArea = std::fabs(e1.x * e2.y - e1.y * e2.x);
+	}
+	else
+	{
+		rec.u = b1;
+		rec.v = b2;
+	}
+	rec.uvScale = area > 0.f ? std::sqrt(uvArea / area) : 0.f;
+	rec.pMat = pMat.get();
+	return true;
+}
+
+inline bool TriangleMesh::boundingBox(float t0, float t1, aabb& outBox) const
+{
+	if (mesh.nodeCount == 0) return false;
+	outBox = box;
+	return true;
+}
+
+#endif
@@ -10,7 +10,7 @@ public:
     glm::vec3 min() const { return minimum; }
     glm::vec3 max() const { return maximum; }
 
-    bool hit(const ray& r, double t_min, double t_max) const {
+    bool hit(const ray& r, real t_min, real t_max) const {
         for (int a = 0; a < 3; a++) {
             auto invD = 1.0f / r.direction()[a];
             auto t0 = (min()[a] - r.origin()[a]) * invD;
@@ -13,16 +13,17 @@ public:
 	BVHnode(const hittable_list& list, float t0, float t1): BVHnode(list.getObjects(), 0, list.size(), t0, t1) {}
 	BVHnode(
 		const std::vector<shared_ptr<hittable>>& src_objects,
-		size_t start, size_t end, double time0, double time1);
-	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		size_t start, size_t end, float time0, float time1);
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+	bool flatten(std::vector<shared_ptr<hittable>>& out) const override;
 protected:
 	std::shared_ptr<hittable> left;
 	std::shared_ptr<hittable> right;
 	aabb box;
 };
 
-inline bool BVHnode::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool BVHnode::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
 	if (!box.hit(r, t_min, t_max)) return false;
 	bool hit_left = left->hit(r, t_min, t_max, rec);
@@ -31,7 +32,7 @@ inline bool BVHnode::hit(const ray& r, double t_min, double t_max, hit_record& r
 	return hit_left || hit_right;
 }
 
-inline BVHnode::BVHnode(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
+inline BVHnode::BVHnode(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1)
 {
 	auto objects = src_objects;
 	int axis = rtnextweek::random_int(0, 2);
@@ -77,5 +78,12 @@ inline bool BVHnode::boundingBox(float t0, float t1, aabb& outBox) const
 	return true;
 }
 
+inline bool BVHnode::flatten(std::vector<shared_ptr<hittable>>& out) const
+{
+	out.push_back(left);
+	if (right != left) out.push_back(right);
+	return true;
+}
+
 
 #endif
\ No newline at end of file
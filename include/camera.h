@@ -10,14 +10,16 @@ using namespace glm;
 class camera
 {
 public:
-	camera(const vec3& e, const vec3& c, const vec3& u, double focal, double width, double height, float _time0 = 0.f, float _time1 = 0.f) :
+	camera(const vec3& e, const vec3& c, const vec3& u, real focal, real width, real height, float _time0 = 0.f, float _time1 = 0.f) :
 		eye(e), center(c), up(u), time0(_time0), time1(_time1),
 		viewToWorld(inverse(lookAt(eye, center, up))),
 		focalLength(focal), screenWidth(width), screenHeight(height),
 		lowerLeftCornerLocal(getLLCL())	{}
 	void setEye(const vec3&);
 	void setCenter(const vec3&);
-	virtual ray getRayFromScreenPos(double u, double v);
+	virtual ray getRayFromScreenPos(real u, real v);
+	// angle between neighbouring pixels of an image this many pixels high
+	float pixelSpread(int imageHeight) const { return static_cast<float>(screenHeight / (focalLength * imageHeight)); }
 protected:
 	vec3 getLLCL();
 	void updateCamera();
@@ -27,9 +29,9 @@ protected:
 	float time0;
 	float time1;
 	mat4 viewToWorld;
-	double focalLength;
-	double screenWidth;
-	double screenHeight;
+	real focalLength;
+	real screenWidth;
+	real screenHeight;
 	vec3 lowerLeftCornerLocal;
 };
 
@@ -58,29 +60,29 @@ inline void camera::updateCamera()
 	lowerLeftCornerLocal = getLLCL();
 }
 
-inline ray camera::getRayFromScreenPos(double u, double v)
+inline ray camera::getRayFromScreenPos(real u, real v)
 {
 	auto pixelPosLocal = lowerLeftCornerLocal + vec3(0.f, u * screenHeight, 0.f) + vec3(v * screenWidth, 0.f, 0.f);
-	float time = rtnextweek::random_double(time0, time1);
+	float time = rtnextweek::random_float(time0, time1);
 	return ray(eye, vec3(viewToWorld * vec4(pixelPosLocal, 1.0f))-eye, time);
 }
 
 class blurcamera: public camera
 {
 public:
-	blurcamera(const vec3& e, const vec3& c, const vec3& u, double focal, double width, double height, double aperture, float _time0 = 0.f, float _time1 = 0.f):
+	blurcamera(const vec3& e, const vec3& c, const vec3& u, real focal, real width, real height, real aperture, float _time0 = 0.f, float _time1 = 0.f):
 			camera(e, c, u, focal, width, height, _time0, _time1), lensRadius(aperture/2) {}
-	ray getRayFromScreenPos(double u, double v) override;
+	ray getRayFromScreenPos(real u, real v) override;
 protected:
-	double lensRadius;
+	real lensRadius;
 };
 
-inline ray blurcamera::getRayFromScreenPos(double u, double v)
+inline ray blurcamera::getRayFromScreenPos(real u, real v)
 {
 	vec3 rd = static_cast<float>(lensRadius) * rtnextweek::random_in_unit_disk();
 	vec3 offset = vec3(rd.x * u, rd.y * v, 0.f);
 	auto pixelPosLocal = lowerLeftCornerLocal + vec3(0.f, u * screenHeight, 0.f) + vec3(v * screenWidth, 0.f, 0.f);
-	float time = rtnextweek::random_double(time0, time1);
+	float time = rtnextweek::random_float(time0, time1);
 	return ray(eye + offset, vec3(viewToWorld * vec4(pixelPosLocal, 1.0f)) - eye - offset, time);
 }
 
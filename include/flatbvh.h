@@ -0,0 +1,274 @@
+#ifndef FLATBVH_H_
+#define FLATBVH_H_
+
+#include "ray.h"
+#include "aabb.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+// Index based BVH shared by the primitive sets. Nodes are stored depth-first in one array:
+// the left child of an interior node directly follows it, the right child is at `offset`.
+struct FlatBVHNode
+{
+	glm::vec3 boxMin;
+	uint32_t offset;	// leaf: first slot in the primitive order, interior: index of the right child
+	glm::vec3 boxMax;
+	uint32_t count;		// primitives in the leaf, 0 for interior nodes
+};
+static_assert(sizeof(FlatBVHNode) == 32, "FlatBVHNode is written to disk as is");
+
+class FlatBVH
+{
+public:
+	static constexpr uint32_t invalidIndex = 0xffffffffu;
+
+	// leaves hold at most leafSize primitives and start at a multiple of leafAlign in order(),
+	// the gaps are filled with invalidIndex
+	void build(std::vector<aabb> bounds, uint32_t leafSize, uint32_t leafAlign = 1);
+	const std::vector<FlatBVHNode>& nodes() const { return bvhNodes; }
+	const std::vector<uint32_t>& order() const { return primOrder; }
+	aabb bounds() const;
+
+	// leaf(offset, count, tMax) tests a leaf, shrinks tMax and returns true on a closer hit
+	template <class LeafFn>
+	static bool traverse(const FlatBVHNode* nodes, const ray& r, float tMin, float tMax, LeafFn&& leaf);
+	// deepest tree traverse() can walk, one stack entry per level
+	static constexpr int stackSize = 96;
+	static bool nodeHit(const FlatBVHNode& node, const glm::vec3& origin, const glm::vec3& invDir,
+		float tMin, float tMax, float& tEntry);
+private:
+	static constexpr int binCount = 12;
+	static constexpr int maxDepth = 48;
+	uint32_t buildNode(uint32_t begin, uint32_t end, int depth);
+	std::vector<FlatBVHNode> bvhNodes;
+	std::vector<uint32_t> primOrder;
+	std::vector<uint32_t> indices;
+	std::vector<aabb> primBounds;
+	std::vector<glm::vec3> centroids;
+	uint32_t maxLeaf = 1;
+	uint32_t align = 1;
+};
+
+inline aabb FlatBVH::bounds() const
+{
+	if (bvhNodes.empty()) return aabb(glm::vec3(0.f), glm::vec3(0.f));
+	return aabb(bvhNodes[0].boxMin, bvhNodes[0].boxMax);
+}
+
+inline void FlatBVH::build(std::vector<aabb> bounds, uint32_t leafSize, uint32_t leafAlign)
+{
+	bvhNodes.clear();
+	primOrder.clear();
+	maxLeaf = std::max(leafSize, 1u);
+	align = std::max(leafAlign, 1u);
+	if (bounds.empty()) return;
+
+	const size_t n = bounds.size();
+	primBounds = std::move(bounds);
+	indices.resize(n);
+	std::iota(indices.begin(), indices.end(), 0u);
+	centroids.resize(n);
+	for (size_t i = 0; i < n; ++i)
+		centroids[i] = 0.5f * (primBounds[i].min() + primBounds[i].max());
+
+	bvhNodes.reserve(2 * n / maxLeaf + 1);
+	primOrder.reserve(n + n / maxLeaf * (align - 1) + align);
+	buildNode(0, static_cast<uint32_t>(n), 0);
+
+	// build scratch is not needed once the order is known
+	std::vector<uint32_t>().swap(indices);
+	std::vector<aabb>().swap(primBounds);
+	std::vector<glm::vec3>().swap(centroids);
+}
+
+inline uint32_t FlatBVH::buildNode(uint32_t begin, uint32_t end, int depth)
+{
+	const uint32_t nodeIndex = static_cast<uint32_t>(bvhNodes.size());
+	bvhNodes.emplace_back();
+
+	glm::vec3 boxMin(std::numeric_limits<float>::max());
+	glm::vec3 boxMax(-std::numeric_limits<float>::max());
+	glm::vec3 cMin = boxMin, cMax = boxMax;
+	for (uint32_t i = begin; i < end; ++i)
+	{
+		boxMin = glm::min(boxMin, primBounds[indices[i]].min());
+		boxMax = glm::max(boxMax, primBounds[indices[i]].max());
+		cMin = glm::min(cMin, centroids[indices[i]]);
+		cMax = glm::max(cMax, centroids[indices[i]]);
+	}
+	bvhNodes[nodeIndex].boxMin = boxMin;
+	bvhNodes[nodeIndex].boxMax = boxMax;
+
+	const uint32_t span = end - begin;
+	if (span <= maxLeaf)
+	{
+		while (primOrder.size() % align != 0) primOrder.push_back(invalidIndex);
+		bvhNodes[nodeIndex].offset = static_cast<uint32_t>(primOrder.size());
+		bvhNodes[nodeIndex].count = span;
+		primOrder.insert(primOrder.end(), indices.begin() + begin, indices.begin() + end);
+		return nodeIndex;
+	}
+
+	const glm::vec3 extent = cMax - cMin;
+	int axis = 0;
+	if (extent.y > extent[axis]) axis = 1;
+	if (extent.z > extent[axis]) axis = 2;
+
+	uint32_t mid = begin + span / 2;
+	bool split = false;
+	if (extent[axis] > 0.f && depth < maxDepth)
+	{
+		// binned SAH along the widest centroid axis
+		struct Bin { glm::vec3 bMin, bMax; uint32_t count; };
+		Bin bins[binCount];
+		for (auto& b : bins)
+		{
+			b.bMin = glm::vec3(std::numeric_limits<float>::max());
+			b.bMax = glm::vec3(-std::numeric_limits<float>::max());
+			b.count = 0;
+		}
+		const float scale = binCount / extent[axis];
+		auto binOf = [&](uint32_t prim)
+		{
+			int b = static_cast<int>((centroids[prim][axis] - cMin[axis]) * scale);
+			return std::min(b, binCount - 1);
+		};
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			Bin& b = bins[binOf(indices[i])];
+			b.bMin = glm::min(b.bMin, primBounds[indices[i]].min());
+			b.bMax = glm::max(b.bMax, primBounds[indices[i]].max());
+			b.count++;
+		}
+		auto area = [](const glm::vec3& lo, const glm::vec3& hi)
+		{
+			glm::vec3 d = glm::max(hi - lo, glm::vec3(0.f));
+			return d.x * d.y + d.y * d.z + d.z * d.x;
+		};
+		float rightArea[binCount];
+		uint32_t rightCount[binCount];
+		glm::vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+		uint32_t n = 0;
+		for (int b = binCount - 1; b > 0; --b)
+		{
+			lo = glm::min(lo, bins[b].bMin);
+			hi = glm::max(hi, bins[b].bMax);
+			n += bins[b].count;
+			rightArea[b] = area(lo, hi);
+			rightCount[b] = n;
+		}
+		lo = glm::vec3(std::numeric_limits<float>::max());
+		hi = glm::vec3(-std::numeric_limits<float>::max());
+		n = 0;
+		float bestCost = std::numeric_limits<float>::max();
+		int bestBin = -1;
+		for (int b = 1; b < binCount; ++b)
+		{
+			lo = glm::min(lo, bins[b - 1].bMin);
+			hi = glm::max(hi, bins[b - 1].bMax);
+			n += bins[b - 1].count;
+			if (n == 0 || rightCount[b] == 0) continue;
+			const float cost = area(lo, hi) * n + rightArea[b] * rightCount[b];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestBin = b;
+			}
+		}
+		if (bestBin > 0)
+		{
+			auto it = std::partition(indices.begin() + begin, indices.begin() + end,
+				[&](uint32_t prim) { return binOf(prim) < bestBin; });
+			mid = static_cast<uint32_t>(it - indices.begin());
+			split = mid != begin && mid != end;
+		}
+	}
+	if (!split)
+	{
+		mid = begin + span / 2;
+		std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+			[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+	}
+
+	buildNode(begin, mid, depth + 1);
+	const uint32_t right = buildNode(mid, end, depth + 1);
+	bvhNodes[nodeIndex].offset = right;
+	bvhNodes[nodeIndex].count = 0;
+	return nodeIndex;
+}
+
+inline bool FlatBVH::nodeHit(const FlatBVHNode& node, const glm::vec3& origin, const glm::vec3& invDir,
+	float tMin, float tMax, float& tEntry)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		float t0 = (node.boxMin[a] - origin[a]) * invDir[a];
+		float t1 = (node.boxMax[a] - origin[a]) * invDir[a];
+		if (invDir[a] < 0.0f) std::swap(t0, t1);
+		tMin = t0 > tMin ? t0 : tMin;
+		tMax = t1 < tMax ? t1 : tMax;
+		if (tMax < tMin) return false;
+	}
+	tEntry = tMin;
+	return true;
+}
+
+template <class LeafFn>
+inline bool FlatBVH::traverse(const FlatBVHNode* nodes, const ray& r, float tMin, float tMax, LeafFn&& leaf)
+{
+	if (nodes == nullptr) return false;
+	const glm::vec3 origin = r.origin();
+	const glm::vec3 invDir = 1.f / r.direction();
+
+	struct Entry { uint32_t node; float t; };
+	Entry stack[stackSize];
+	int top = 0;
+	bool hitAnything = false;
+
+	float tEntry;
+	if (!nodeHit(nodes[0], origin, invDir, tMin, tMax, tEntry)) return false;
+	stack[top++] = { 0, tEntry };
+	while (top > 0)
+	{
+		const Entry e = stack[--top];
+		if (e.t > tMax) continue;
+		uint32_t index = e.node;
+		while (true)
+		{
+			const FlatBVHNode& node = nodes[index];
+			if (node.count > 0)
+			{
+				if (leaf(node.offset, node.count, tMax)) hitAnything = true;
+				break;
+			}
+			const uint32_t left = index + 1;
+			const uint32_t right = node.offset;
+			float tLeft, tRight;
+			const bool hitLeft = nodeHit(nodes[left], origin, invDir, tMin, tMax, tLeft);
+			const bool hitRight = nodeHit(nodes[right], origin, invDir, tMin, tMax, tRight);
+			if (hitLeft && hitRight)
+			{
+				// descend into the nearer child, the farther one waits on the stack
+				if (tRight < tLeft)
+				{
+					stack[top++] = { left, tLeft };
+					index = right;
+				}
+				else
+				{
+					stack[top++] = { right, tRight };
+					index = left;
+				}
+			}
+			else if (hitLeft) index = left;
+			else if (hitRight) index = right;
+			else break;
+		}
+	}
+	return hitAnything;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ray.h"
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include "glm/fwd.hpp"
@@ -12,74 +13,178 @@ using std::make_shared;
 using std::vector;
 
 class material;
-
+class MaterialTable;
 
 struct hit_record {
     glm::vec3 p;
     glm::vec3 normal;
-    shared_ptr<material> pMat;
-    double t;
+    const material* pMat;   // owned by the primitive that was hit, never refcounted while tracing
+    uint32_t materialId = noMaterial;   // pMat's record in the scene's MaterialTable, if it has one
+    real t;
     float u;
     float v;
+    float uvScale = 0.f;    // change in uv per unit of distance along the surface at p, 0 if unknown
+    float footprint = 0.f;  // width the ray covers at p, for texture filtering, set by the integrator
     bool front_face;
 
 	void set_face_normal(const ray& r, const glm::vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    static constexpr uint32_t noMaterial = ~0u;
+};
+
+// Plain data forms of the built-in primitives, used by CompiledScene for static dispatch.
+enum class PrimitiveType : uint32_t { Sphere, MovingSphere, XYRect, YZRect, XZRect, Box, Generic };
+
+struct SpherePrim {
+    glm::vec3 center;
+    float radius;
+    const material* pMat;
+};
+
+struct MovingSpherePrim {
+    glm::vec3 center0;
+    float time0;
+    glm::vec3 center1;
+    float time1;
+    float radius;
+    const material* pMat;
+};
+
+// axis aligned rectangle [a0,a1]x[b0,b1] in the plane at k, the axes depend on the rect type
+struct RectPrim {
+    float a0, a1, b0, b1, k;
+    const material* pMat;
+};
+
+struct BoxPrim {
+    glm::vec3 boxMin;
+    glm::vec3 boxMax;
+    const material* pMat;
+};
+
+struct PrimitiveStore {
+    vector<SpherePrim> spheres;
+    vector<MovingSpherePrim> movingSpheres;
+    vector<RectPrim> rects;
+    vector<BoxPrim> boxes;
+};
+
+// shape an integrator can sample points on, the light is used if its material is emissive
+struct LightPrim {
+    PrimitiveType type;     // Sphere, XYRect, YZRect or XZRect
+    SpherePrim sphere;
+    RectPrim rect;
+
+    const material* pMat() const { return type == PrimitiveType::Sphere ? sphere.pMat : rect.pMat; }
 };
 
 class hittable {
 public:
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
     virtual bool boundingBox(float t0, float t1, aabb& outBox) const = 0;
+    // appends the plain data form of a built-in primitive and returns its type,
+    // Generic means the object has none and is called through hit()
+    virtual PrimitiveType lower(PrimitiveStore& store) const { return PrimitiveType::Generic; }
+    // containers append their children and return true so they can be flattened away
+    virtual bool flatten(vector<shared_ptr<hittable>>& out) const { return false; }
+    // where the whole line through r enters and leaves a closed convex object, used by media
+    virtual bool hitInterval(const ray& r, real& tEnter, real& tExit) const;
+    // transform wrappers report the object-to-world matrix they apply and the object they wrap
+    virtual bool asTransform(glm::mat4& objectToWorld, shared_ptr<hittable>& child) const { return false; }
+    // an equivalent object with its wrapped transform chains folded (see Instance::fold), or nullptr
+    virtual shared_ptr<hittable> folded() const { return nullptr; }
+    // appends the shapes that can be sampled as lights, the default uses the lowered form
+    virtual void collectLights(vector<LightPrim>& out) const;
+    // table the material indices of hit records from this object refer to, if it has one
+    virtual const MaterialTable* materials() const { return nullptr; }
 };
 
+inline bool hittable::hitInterval(const ray& r, real& tEnter, real& tExit) const
+{
+    hit_record rec1, rec2;
+    float fMax = std::numeric_limits<float>::max();
+    float fMin = -fMax;
+    // must hit twice(hit through boundary)
+    if (!hit(r, fMin, fMax, rec1)) return false;
+    if (!hit(r, rec1.t + real(0.0001), fMax, rec2)) return false;
+    tEnter = rec1.t;
+    tExit = rec2.t;
+    return true;
+}
+
+inline void hittable::collectLights(vector<LightPrim>& out) const
+{
+    PrimitiveStore store;
+    const PrimitiveType type = lower(store);
+    if (type == PrimitiveType::Sphere) out.push_back({ type, store.spheres[0], {} });
+    else if (type == PrimitiveType::XYRect || type == PrimitiveType::YZRect || type == PrimitiveType::XZRect)
+        out.push_back({ type, {}, store.rects[0] });
+}
+
 
 aabb surrounding_box(aabb box0, aabb box1);
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis);
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b);
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b);
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b);
+inline bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis);
+bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b);
+bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b);
+bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b);
 
 class sphere: public hittable
 {
 public:
-    sphere(const glm::vec3&, double, shared_ptr<material>);
-    virtual bool hit(const ray&, double, double, hit_record&) const override;
+    sphere(const glm::vec3&, real, shared_ptr<material>);
+    virtual bool hit(const ray&, real, real, hit_record&) const override;
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
+    PrimitiveType lower(PrimitiveStore& store) const override;
+    static void get_sphere_uv(const glm::vec3& p, float& u, float& v);
+    // uvScale of get_sphere_uv at unit normal p, from the area the texture is stretched over
+    static float uv_scale(real radius, const glm::vec3& p);
+    // nearest root in [tMin, tMax] of a ray against a sphere, shared by all sphere kinds
+    static bool intersect(const glm::vec3& center, real radius, const ray& r, real tMin, real tMax, real& t);
 protected:
     glm::vec3 center;
-    double radius;
+    real radius;
     shared_ptr<material> pMat;
-    static void get_sphere_uv(const glm::vec3& p, float& u, float& v);
 };
 
-inline sphere::sphere(const glm::vec3& c, double r, shared_ptr<material> pm)
+inline sphere::sphere(const glm::vec3& c, real r, shared_ptr<material> pm)
 		: center(c), radius(r), pMat(pm) {}
 
-inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool sphere::intersect(const glm::vec3& center, real radius, const ray& r, real tMin, real tMax, real& t)
 {
     glm::vec3 oc = r.origin() - center;
-    auto a = glm::dot(r.direction(), r.direction());
-	auto halfB = glm::dot(oc, r.direction());
-    auto c = glm::dot(oc, oc) - radius * radius;
-    auto discriminant = halfB * halfB - a * c;
+    real a = glm::dot(r.direction(), r.direction());
+    real halfB = glm::dot(oc, r.direction());
+    // radius^2 - |oc - (halfB/a)d|^2 instead of halfB^2 - a*c, which cancels badly in single
+    // precision on big spheres like the ground
+    glm::vec3 f = oc - static_cast<float>(halfB / a) * r.direction();
+    real discriminant = a * (radius * radius - glm::dot(f, f));
     if (discriminant < 0) { return false; }
-    auto sqrtd = sqrt(discriminant);
-    auto root = (-halfB - sqrtd) / a;
+    real sqrtd = std::sqrt(discriminant);
+    real root = (-halfB - sqrtd) / a;
 
-    if (root < t_min || t_max < root) {
+    if (root < tMin || tMax < root) {
         root = (-halfB + sqrtd) / a;
-        if (root < t_min || t_max < root)
+        if (root < tMin || tMax < root)
             return false;
     }
+    t = root;
+    return true;
+}
+
+inline bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    real root;
+    if (!intersect(center, radius, r, t_min, t_max, root)) return false;
     rec.t = root;
     rec.p = r.at(root);
     glm::vec3 outward_normal = (rec.p - center) / static_cast<float>(radius);
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.pMat = pMat;
+    rec.uvScale = uv_scale(radius, outward_normal);
+    rec.pMat = pMat.get();
     return true;
 }
 
@@ -89,15 +194,28 @@ inline bool sphere::boundingBox(float t0, float t1, aabb& outBox) const
     return true;
 }
 
+inline PrimitiveType sphere::lower(PrimitiveStore& store) const
+{
+    store.spheres.push_back({ center, static_cast<float>(radius), pMat.get() });
+    return PrimitiveType::Sphere;
+}
+
 inline void sphere::get_sphere_uv(const glm::vec3& p, float& u, float& v)
 {
-    float theta = acos(-p.y);
-    float phi = atan2(-p.z, p.x) + glm::pi<float>();
+    float theta = std::acos(-p.y);
+    float phi = std::atan2(-p.z, p.x) + glm::pi<float>();
 
     u = phi / (2.f * glm::pi<float>());
     v = theta / glm::pi<float>();
 }
 
+inline float sphere::uv_scale(real radius, const glm::vec3& p)
+{
+    // u spans 2 pi r sin(theta), v spans pi r
+    const float sinTheta = std::max(std::sqrt(std::max(0.f, 1.f - p.y * p.y)), 1e-3f);
+    return 1.f / (glm::pi<float>() * static_cast<float>(radius) * std::sqrt(2.f * sinTheta));
+}
+
 class hittable_list : public hittable
 {
 public:
@@ -105,8 +223,13 @@ public:
     hittable_list(shared_ptr<hittable> obj) { add(obj); }
     vector<shared_ptr<hittable>> getObjects() const;
     size_t size() const { return objects.size(); }
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
+    bool flatten(vector<shared_ptr<hittable>>& out) const override;
+    void collectLights(vector<LightPrim>& out) const override
+    {
+        for (const auto& obj : objects) obj->collectLights(out);
+    }
     void add(shared_ptr<hittable> obj) { objects.push_back(obj); }
     void clear() { objects.clear(); }
 private:
@@ -118,18 +241,17 @@ inline vector<shared_ptr<hittable>> hittable_list::getObjects() const
     return objects;
 }
 
-inline bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+    // a primitive only writes rec when it finds a closer hit, so no temporary record is needed
     bool hitAnything = false;
-    hit_record tempRecord;
-    double far = t_max;
-	for(auto obj : objects)
+    real far = t_max;
+	for(const auto& obj : objects)
 	{
-		if(obj->hit(r, t_min, far, tempRecord))
+		if(obj->hit(r, t_min, far, rec))
 		{
             hitAnything = true;
-            rec = tempRecord;
-            far = tempRecord.t;
+            far = rec.t;
 		}
 	}
     return hitAnything;
@@ -149,21 +271,28 @@ inline bool hittable_list::boundingBox(float t0, float t1, aabb& outBox) const
     return true;
 }
 
+inline bool hittable_list::flatten(vector<shared_ptr<hittable>>& out) const
+{
+    out.insert(out.end(), objects.begin(), objects.end());
+    return true;
+}
+
 class movingsphere : public hittable
 {
 public:
-    movingsphere(const glm::vec3& c0, const glm::vec3& c1, float t0, float t1, double r, shared_ptr<material> mat);
-    virtual bool hit(const ray& r, double tMin, double tMax, hit_record&) const override;
+    movingsphere(const glm::vec3& c0, const glm::vec3& c1, float t0, float t1, real r, shared_ptr<material> mat);
+    virtual bool hit(const ray& r, real tMin, real tMax, hit_record&) const override;
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
+    PrimitiveType lower(PrimitiveStore& store) const override;
     glm::vec3 getCenter(float t)const;
 protected:
     glm::vec3 center0, center1;
     float time0, time1;
-    double radius;
+    real radius;
     shared_ptr<material> pMat;
 };
 
-inline movingsphere::movingsphere(const glm::vec3& c0, const glm::vec3& c1, float t0, float t1, double r, shared_ptr<material> mat)
+inline movingsphere::movingsphere(const glm::vec3& c0, const glm::vec3& c1, float t0, float t1, real r, shared_ptr<material> mat)
 	: center0(c0), center1(c1), time0(t0), time1(t1), radius(r), pMat(std::move(mat)) {}
 
 inline glm::vec3 movingsphere::getCenter(float t) const
@@ -171,28 +300,16 @@ inline glm::vec3 movingsphere::getCenter(float t) const
     return center0 + ((t - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-inline bool movingsphere::hit(const ray& r, double tMin, double tMax, hit_record& rec) const
+inline bool movingsphere::hit(const ray& r, real tMin, real tMax, hit_record& rec) const
 {
     glm::vec3 center = getCenter(r.time());
-    glm::vec3 oc = r.origin() - center;
-    auto a = glm::dot(r.direction(), r.direction());
-    auto halfB = glm::dot(oc, r.direction());
-    auto c = glm::dot(oc, oc) - radius * radius;
-    auto discriminant = halfB * halfB - a * c;
-    if (discriminant < 0) { return false; }
-    auto sqrtd = sqrt(discriminant);
-    auto root = (-halfB - sqrtd) / a;
-
-    if (root < tMin || tMax < root) {
-        root = (-halfB + sqrtd) / a;
-        if (root < tMin || tMax < root)
-            return false;
-    }
+    real root;
+    if (!sphere::intersect(center, radius, r, tMin, tMax, root)) return false;
     rec.t = root;
     rec.p = r.at(root);
     glm::vec3 outward_normal = (rec.p - center) / static_cast<float>(radius);
     rec.set_face_normal(r, outward_normal);
-    rec.pMat = pMat;
+    rec.pMat = pMat.get();
     return true;
 }
 
@@ -206,12 +323,19 @@ inline bool movingsphere::boundingBox(float t0, float t1, aabb& outBox) const
     return true;
 }
 
+inline PrimitiveType movingsphere::lower(PrimitiveStore& store) const
+{
+    store.movingSpheres.push_back({ center0, time0, center1, time1, static_cast<float>(radius), pMat.get() });
+    return PrimitiveType::MovingSphere;
+}
+
 class XYRect: public hittable
 {
 public:
     XYRect(float _x0, float _x1, float _y0, float _y1, float _z, shared_ptr<material> _mat);
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
-    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    PrimitiveType lower(PrimitiveStore& store) const override;
 protected:
     float x0, x1, y0, y1, k;
     shared_ptr<material> pMat;
@@ -220,13 +344,19 @@ protected:
 inline XYRect::XYRect(float _x0, float _x1, float _y0, float _y1, float _z, shared_ptr<material> _mat):
 		x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_z), pMat(std::move(_mat)) {}
 
+inline PrimitiveType XYRect::lower(PrimitiveStore& store) const
+{
+    store.rects.push_back({ x0, x1, y0, y1, k, pMat.get() });
+    return PrimitiveType::XYRect;
+}
+
 inline bool XYRect::boundingBox(float t0, float t1, aabb& outBox) const
 {
     outBox = aabb(glm::vec3(x0, y0, k - 0.001f), glm::vec3(x1, y1, k + 0.001f));
     return true;
 }
 
-inline bool XYRect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool XYRect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
     float t = (k - r.origin().z) / r.direction().z;
     if (t < t_min || t > t_max) { return false; }
@@ -235,11 +365,13 @@ inline bool XYRect::hit(const ray& r, double t_min, double t_max, hit_record& re
     if (x < x0 || x > x1 || y < y0 || y > y1) { return false; }
     auto outward_normal = glm::vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.pMat = pMat;
+    rec.pMat = pMat.get();
     rec.t = t;
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (y - y0) / (y1 - y0);
+    rec.uvScale = 1.f / std::sqrt((x1 - x0) * (y1 - y0));
     rec.p = r.at(t);
+    return true;
 }
 
 class YZRect :public hittable
@@ -247,7 +379,8 @@ class YZRect :public hittable
 public:
     YZRect(float _y0, float _y1, float _z0, float _z1, float _x, shared_ptr<material> _mat);
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
-    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    PrimitiveType lower(PrimitiveStore& store) const override;
 protected:
     float y0, y1, z0, z1, k;
     shared_ptr<material> pMat;
@@ -256,13 +389,19 @@ protected:
 inline YZRect::YZRect(float _y0, float _y1, float _z0, float _z1, float _x, shared_ptr<material> _mat) :
 	y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_x), pMat(std::move(_mat)) {}
 
+inline PrimitiveType YZRect::lower(PrimitiveStore& store) const
+{
+    store.rects.push_back({ y0, y1, z0, z1, k, pMat.get() });
+    return PrimitiveType::YZRect;
+}
+
 inline bool YZRect::boundingBox(float t0, float t1, aabb& outBox) const
 {
     outBox = aabb(glm::vec3(k - 0.001f, y0, z0), glm::vec3(k + 0.001f, y1, z1));
     return true;
 }
 
-inline bool YZRect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool YZRect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
     auto t = (k - r.origin().x) / r.direction().x;
     if (t < t_min || t > t_max)
@@ -273,10 +412,11 @@ inline bool YZRect::hit(const ray& r, double t_min, double t_max, hit_record& re
         return false;
     rec.u = (y - y0) / (y1 - y0);
     rec.v = (z - z0) / (z1 - z0);
+    rec.uvScale = 1.f / std::sqrt((y1 - y0) * (z1 - z0));
     rec.t = t;
     auto outward_normal = glm::vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.pMat = pMat;
+    rec.pMat = pMat.get();
     rec.p = r.at(t);
     return true;
 }
@@ -286,7 +426,8 @@ class XZRect : public hittable
 public:
     XZRect(float _x0, float _x1, float _z0, float _z1, float _y, shared_ptr<material> _mat);
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
-    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    PrimitiveType lower(PrimitiveStore& store) const override;
 protected:
     float x0, x1, z0, z1, k;
     shared_ptr<material> pMat;
@@ -295,13 +436,19 @@ protected:
 inline XZRect::XZRect(float _x0, float _x1, float _z0, float _z1, float _y, shared_ptr<material> _mat) :
     x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_y), pMat(std::move(_mat)) {}
 
+inline PrimitiveType XZRect::lower(PrimitiveStore& store) const
+{
+    store.rects.push_back({ x0, x1, z0, z1, k, pMat.get() });
+    return PrimitiveType::XZRect;
+}
+
 inline bool XZRect::boundingBox(float t0, float t1, aabb& outBox) const
 {
     outBox = aabb(glm::vec3(x0, k - 0.001f, z0), glm::vec3(x1, k + 0.001f, z1));
     return true;
 }
 
-inline bool XZRect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool XZRect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
     float t = (k - r.origin().y) / r.direction().y;
     if (t < t_min || t > t_max) { return false; }
@@ -310,11 +457,98 @@ inline bool XZRect::hit(const ray& r, double t_min, double t_max, hit_record& re
     if (x < x0 || x > x1 || z < z0 || z > z1) { return false; }
     auto outward_normal = glm::vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.pMat = pMat;
+    rec.pMat = pMat.get();
     rec.t = t;
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (z - z0) / (z1 - z0);
+    rec.uvScale = 1.f / std::sqrt((x1 - x0) * (z1 - z0));
+    rec.p = r.at(t);
+    return true;
+}
+
+// Infinite plane through point with the given normal. It has no bounding box, so
+// CompiledScene keeps it in the unbounded list instead of stretching the BVH around it.
+class Plane : public hittable
+{
+public:
+    Plane(const glm::vec3& point, const glm::vec3& normal, shared_ptr<material> mat);
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    bool boundingBox(float t0, float t1, aabb& outBox) const override { return false; }
+protected:
+    glm::vec3 point;
+    glm::vec3 normal;
+    glm::vec3 tangent;      // u direction of the texture coordinates, v is normal x tangent
+    shared_ptr<material> pMat;
+};
+
+inline Plane::Plane(const glm::vec3& point, const glm::vec3& normal, shared_ptr<material> mat)
+    : point(point), normal(glm::normalize(normal)), pMat(std::move(mat))
+{
+    const glm::vec3 helper = std::fabs(this->normal.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+    tangent = glm::normalize(glm::cross(helper, this->normal));
+}
+
+inline bool Plane::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    float denom = glm::dot(normal, r.direction());
+    if (std::fabs(denom) < 1e-8f) { return false; }
+    float t = glm::dot(point - r.origin(), normal) / denom;
+    if (t < t_min || t > t_max) { return false; }
+    rec.t = t;
     rec.p = r.at(t);
+    rec.set_face_normal(r, normal);
+    // texture coordinates repeat every unit along the plane
+    glm::vec3 local = rec.p - point;
+    float u = glm::dot(local, tangent);
+    float v = glm::dot(local, glm::cross(normal, tangent));
+    rec.u = u - std::floor(u);
+    rec.v = v - std::floor(v);
+    rec.uvScale = 1.f;
+    rec.pMat = pMat.get();
+    return true;
+}
+
+// Flat disk, a bounded piece of a plane
+class Disk : public Plane
+{
+public:
+    Disk(const glm::vec3& center, const glm::vec3& normal, float radius, shared_ptr<material> mat)
+        : Plane(center, normal, std::move(mat)), radius(radius) {}
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    bool boundingBox(float t0, float t1, aabb& outBox) const override;
+private:
+    float radius;
+};
+
+inline bool Disk::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    float denom = glm::dot(normal, r.direction());
+    if (std::fabs(denom) < 1e-8f) { return false; }
+    float t = glm::dot(point - r.origin(), normal) / denom;
+    if (t < t_min || t > t_max) { return false; }
+    glm::vec3 p = r.at(t);
+    glm::vec3 local = p - point;
+    if (glm::dot(local, local) > radius * radius) { return false; }
+    rec.t = t;
+    rec.p = p;
+    rec.set_face_normal(r, normal);
+    rec.u = 0.5f + glm::dot(local, tangent) / (2.f * radius);
+    rec.v = 0.5f + glm::dot(local, glm::cross(normal, tangent)) / (2.f * radius);
+    rec.uvScale = 1.f / (2.f * radius);
+    rec.pMat = pMat.get();
+    return true;
+}
+
+inline bool Disk::boundingBox(float t0, float t1, aabb& outBox) const
+{
+    // extent along each axis is radius * sin of the angle between the axis and the normal,
+    // padded like the rects so an axis aligned disk has a non-zero thickness
+    glm::vec3 extent;
+    for (int a = 0; a < 3; a++) {
+        extent[a] = radius * std::sqrt(std::fmax(0.f, 1.f - normal[a] * normal[a])) + 0.001f;
+    }
+    outBox = aabb(point - extent, point + extent);
+    return true;
 }
 
 class Box : public hittable
@@ -323,24 +557,24 @@ public:
     Box() = default;
     Box(const glm::vec3& p0, const glm::vec3& p1, shared_ptr<material> pMat, 
         const glm::mat4& t = glm::mat4(1.f), const glm::mat4& s = glm::mat4(1.f), const glm::mat4& r = glm::mat4(1.f));
-    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
+    PrimitiveType lower(PrimitiveStore& store) const override;
+    bool hitInterval(const ray& r, real& tEnter, real& tExit) const override;
+
+    // slab test against the whole line, the axes are the ones whose faces are crossed
+    static bool slab(const glm::vec3& boxMin, const glm::vec3& boxMax, const ray& r,
+        float& tEnter, float& tExit, int& enterAxis, int& exitAxis);
+    // fills rec for a hit at t on a face perpendicular to axis, uvs follow the rect of that face
+    static void faceHit(const glm::vec3& boxMin, const glm::vec3& boxMax, const ray& r, float t, int axis, hit_record& rec);
 private:
     glm::vec3 boxMin;
     glm::vec3 boxMax;
-    hittable_list sides;
+    shared_ptr<material> pMat;
 };
 
 inline Box::Box(const glm::vec3& p0, const glm::vec3& p1, shared_ptr<material> pMat, 
-    const glm::mat4& t, const glm::mat4& s, const glm::mat4& r): boxMin(p0), boxMax(p1)
-{
-    sides.add(make_shared<XYRect>(p0.x, p1.x, p0.x, p1.y, p0.z, pMat));
-    sides.add(make_shared<XYRect>(p0.x, p1.x, p0.x, p1.y, p1.z, pMat));
-    sides.add(make_shared<XZRect>(p0.x, p1.x, p0.z, p1.z, p0.y, pMat));
-    sides.add(make_shared<XZRect>(p0.x, p1.x, p0.z, p1.z, p1.y, pMat));
-    sides.add(make_shared<YZRect>(p0.y, p1.y, p0.z, p1.z, p0.x, pMat));
-    sides.add(make_shared<YZRect>(p0.y, p1.y, p0.z, p1.z, p1.x, pMat));
-}
+    const glm::mat4& t, const glm::mat4& s, const glm::mat4& r): boxMin(p0), boxMax(p1), pMat(pMat) {}
 
 inline bool Box::boundingBox(float t0, float t1, aabb& outBox) const
 {
@@ -348,23 +582,90 @@ inline bool Box::boundingBox(float t0, float t1, aabb& outBox) const
     return true;
 }
 
-inline bool Box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline PrimitiveType Box::lower(PrimitiveStore& store) const
+{
+    store.boxes.push_back({ boxMin, boxMax, pMat.get() });
+    return PrimitiveType::Box;
+}
+
+inline bool Box::slab(const glm::vec3& boxMin, const glm::vec3& boxMax, const ray& r,
+    float& tEnter, float& tExit, int& enterAxis, int& exitAxis)
+{
+    tEnter = -std::numeric_limits<float>::infinity();
+    tExit = std::numeric_limits<float>::infinity();
+    enterAxis = exitAxis = 0;
+    for (int a = 0; a < 3; a++) {
+        const float invD = 1.0f / r.direction()[a];
+        float t0 = (boxMin[a] - r.origin()[a]) * invD;
+        float t1 = (boxMax[a] - r.origin()[a]) * invD;
+        if (invD < 0.0f) std::swap(t0, t1);
+        if (t0 > tEnter) tEnter = t0, enterAxis = a;
+        if (t1 < tExit) tExit = t1, exitAxis = a;
+    }
+    return tEnter <= tExit;
+}
+
+inline void Box::faceHit(const glm::vec3& boxMin, const glm::vec3& boxMax, const ray& r, float t, int axis, hit_record& rec)
+{
+    rec.t = t;
+    rec.p = r.at(t);
+    glm::vec3 outward_normal(0.f);
+    outward_normal[axis] = rec.p[axis] - boxMin[axis] < boxMax[axis] - rec.p[axis] ? -1.f : 1.f;
+    rec.set_face_normal(r, outward_normal);
+    const int a = axis == 0 ? 1 : 0;
+    const int b = axis == 2 ? 1 : 2;
+    rec.u = (rec.p[a] - boxMin[a]) / (boxMax[a] - boxMin[a]);
+    rec.v = (rec.p[b] - boxMin[b]) / (boxMax[b] - boxMin[b]);
+    rec.uvScale = 1.f / std::sqrt((boxMax[a] - boxMin[a]) * (boxMax[b] - boxMin[b]));
+}
+
+inline bool Box::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    float tEnter, tExit;
+    int enterAxis, exitAxis;
+    if (!slab(boxMin, boxMax, r, tEnter, tExit, enterAxis, exitAxis)) return false;
+    float t = tEnter;
+    int axis = enterAxis;
+    if (t < t_min) t = tExit, axis = exitAxis;
+    if (t < t_min || t > t_max) return false;
+    faceHit(boxMin, boxMax, r, t, axis, rec);
+    rec.pMat = pMat.get();
+    return true;
+}
+
+inline bool Box::hitInterval(const ray& r, real& tEnter, real& tExit) const
 {
-    return sides.hit(r, t_min, t_max, rec);
+    float t0, t1;
+    int enterAxis, exitAxis;
+    if (!slab(boxMin, boxMax, r, t0, t1, enterAxis, exitAxis)) return false;
+    tEnter = t0;
+    tExit = t1;
+    return true;
 }
 
 class Translate : public hittable
 {
 public:
     Translate(shared_ptr<hittable> p, const glm::vec3& displacement) : ptr(p), offset(displacement) {}
-	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
     bool boundingBox(float t0, float t1, aabb& outBox) const override;
+    bool hitInterval(const ray& r, real& tEnter, real& tExit) const override
+    {
+        return ptr->hitInterval(ray(r.origin() - offset, r.direction(), r.time()), tEnter, tExit);
+    }
+    bool asTransform(glm::mat4& objectToWorld, shared_ptr<hittable>& child) const override
+    {
+        objectToWorld = glm::mat4(1.f);
+        objectToWorld[3] = glm::vec4(offset, 1.f);
+        child = ptr;
+        return true;
+    }
 private:
     shared_ptr<hittable> ptr;
     glm::vec3 offset;
 };
 
-inline bool Translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool Translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
     ray movedR = ray(r.origin() - offset, r.direction(), r.time());
     if (!ptr->hit(movedR, t_min, t_max, rec)) return false;
@@ -386,9 +687,25 @@ class RotateY : public hittable
 public:
     RotateY(shared_ptr<hittable> p, float angle);
 
-	bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 	bool boundingBox(float t0, float t1, aabb& outBox) const override;
+    bool hitInterval(const ray& r, real& tEnter, real& tExit) const override
+    {
+        return ptr->hitInterval(toLocal(r), tEnter, tExit);
+    }
+    bool asTransform(glm::mat4& objectToWorld, shared_ptr<hittable>& child) const override
+    {
+        // the inverse of toLocal, columns of the rotation about y
+        objectToWorld = glm::mat4(1.f);
+        objectToWorld[0] = glm::vec4(cosTheta, 0.f, -sinTheta, 0.f);
+        objectToWorld[2] = glm::vec4(sinTheta, 0.f, cosTheta, 0.f);
+        child = ptr;
+        return true;
+    }
 private:
+    // rotates r into the space of the wrapped object, t stays the same along it
+    ray toLocal(const ray& r) const;
+
     shared_ptr<hittable> ptr;
     float sinTheta;
     float cosTheta;
@@ -438,7 +755,7 @@ inline bool RotateY::boundingBox(float t0, float t1, aabb& outBox) const
 }
 
 
-inline bool RotateY::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline ray RotateY::toLocal(const ray& r) const
 {
     auto origin = r.origin();
     auto direction = r.direction();
@@ -449,7 +766,12 @@ inline bool RotateY::hit(const ray& r, double t_min, double t_max, hit_record& r
     direction[0] = cosTheta * r.direction()[0] - sinTheta * r.direction()[2];
     direction[2] = sinTheta * r.direction()[0] + cosTheta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+}
+
+inline bool RotateY::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    ray rotated_r = toLocal(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
@@ -483,7 +805,7 @@ aabb surrounding_box(aabb box0, aabb box1) {
     return aabb(small, big);
 }
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
+inline bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis) {
     aabb box_a;
     aabb box_b;
 
@@ -493,14 +815,14 @@ inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable>
     return box_a.min()[axis] < box_b.min()[axis];
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 0);
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 1);
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 2);
 }
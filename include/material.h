@@ -7,16 +7,137 @@
 
 using namespace glm;
 
+// A direction picked by material::sample. weight is f * cos / pdf, what the path's throughput is
+// multiplied by. pdf is 0 when the material scatters into a single direction, f is then unused.
+struct ScatterRecord
+{
+	ray scattered;
+	vec3 weight;
+	vec3 f;
+	float pdf;
+};
+
+// Plain form of the built-in materials, used by MaterialTable to shade without virtual calls
+enum class MaterialType : uint32_t { Lambertian, Metal, FuzzyMetal, Dielectric, DiffuseLight, Isotropic, Virtual };
+
+struct MaterialRecord {
+	vec3 color;			// albedo or emission when there is no texture
+	float param;		// FuzzyMetal lobe exponent, dielectric index of refraction
+	uint32_t texture;	// index into the table's textures or noTexture
+	MaterialType type;
+
+	static constexpr uint32_t noTexture = ~0u;
+};
+
+// The scattering functions of the built-in materials, shared by the classes below and by
+// MaterialTable. Albedos come in already looked up.
+namespace bsdf
+{
+	inline bool lambertianSample(const vec3& albedo, const ray& rIn, const hit_record& record, ScatterRecord& out)
+	{
+		// cosine weighted, so f * cos / pdf is just the albedo
+		const vec3 wi = rtnextweek::random_cosine_direction(record.normal);
+		const float cosine = std::max(dot(wi, record.normal), 0.f);
+		out.scattered = ray(record.p, wi, rIn.time());
+		out.weight = albedo;
+		out.pdf = cosine / glm::pi<float>();
+		out.f = albedo * out.pdf;
+		return true;
+	}
+	inline float lambertianPdf(const hit_record& record, const vec3& wi)
+	{
+		return std::max(dot(normalize(wi), record.normal), 0.f) / glm::pi<float>();
+	}
+
+	inline bool mirrorSample(const vec3& albedo, const ray& rIn, const hit_record& record, ScatterRecord& out)
+	{
+		out.scattered = ray(record.p, rtnextweek::reflect(glm::normalize(rIn.direction()), record.normal), rIn.time());
+		out.weight = albedo;
+		out.f = vec3(0.f);
+		out.pdf = 0.f;
+		return true;
+	}
+
+	// normalized Phong lobe around the mirror direction, also the BSDF times cosine per unit albedo
+	inline float phongPdf(float exponent, const ray& rIn, const hit_record& record, const vec3& wi)
+	{
+		const vec3 mirror = rtnextweek::reflect(glm::normalize(rIn.direction()), record.normal);
+		const float cosine = dot(mirror, glm::normalize(wi));
+		if (cosine <= 0.f) return 0.f;
+		return (exponent + 1.f) / (2.f * glm::pi<float>()) * std::pow(cosine, exponent);
+	}
+	inline vec3 phongEvaluate(const vec3& albedo, float exponent, const ray& rIn, const hit_record& record, const vec3& wi)
+	{
+		if (dot(wi, record.normal) <= 0.f) return vec3(0.f);
+		return albedo * phongPdf(exponent, rIn, record, wi);
+	}
+	inline bool phongSample(const vec3& albedo, float exponent, const ray& rIn, const hit_record& record, ScatterRecord& out)
+	{
+		const vec3 mirror = rtnextweek::reflect(glm::normalize(rIn.direction()), record.normal);
+		const vec3 wi = rtnextweek::random_phong_direction(mirror, exponent);
+		if (dot(wi, record.normal) <= 0.f) return false;
+		out.scattered = ray(record.p, wi, rIn.time());
+		out.weight = albedo;
+		out.pdf = phongPdf(exponent, rIn, record, wi);
+		out.f = albedo * out.pdf;
+		return true;
+	}
+
+	inline bool dielectricSample(float ir, const ray& rIn, const hit_record& record, ScatterRecord& out)
+	{
+		float refraction_ratio = record.front_face ? (1.f / ir) : ir;
+		vec3 unit_direction = normalize(rIn.direction());
+		float cos_theta = std::fmin(dot(-unit_direction, record.normal), 1.f);
+		float sin_theta = std::sqrt(1.f - cos_theta * cos_theta);
+		bool cannot_refract = refraction_ratio * sin_theta > 1.f;
+		vec3 direction;
+		if (cannot_refract) { direction = rtnextweek::reflect(unit_direction, record.normal); }
+		else { direction = rtnextweek::refract(unit_direction, record.normal, refraction_ratio); }
+		out.scattered = ray(record.p, direction, rIn.time());
+		out.weight = vec3(1.0, 1.0, 1.0);
+		out.f = vec3(0.f);
+		out.pdf = 0.f;
+		return true;
+	}
+
+	inline bool isotropicSample(const vec3& albedo, const ray& rIn, const hit_record& record, ScatterRecord& out)
+	{
+		out.scattered = ray(record.p, rtnextweek::random_unit_vector(), rIn.time());
+		out.weight = albedo;
+		out.pdf = 1.f / (4.f * glm::pi<float>());
+		out.f = albedo * out.pdf;
+		return true;
+	}
+}
+
 class material
 {
 public:
 	virtual bool scatter(
 		const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered
 	) const = 0;
+	// scatter() with the BSDF value and density of the picked direction, so the integrator can
+	// weight it against light samples. The default is single direction scattering.
+	virtual bool sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const
+	{
+		out.f = vec3(0.f);
+		out.pdf = 0.f;
+		return scatter(rIn, record, out.weight, out.scattered);
+	}
 	virtual vec3 emitted(float, float, const vec3&) const
 	{
 		return vec3(0, 0, 0);
 	}
+	// lights are sampled directly by the integrator
+	virtual bool isEmissive() const { return false; }
+	// BSDF times cosine for light leaving along -rIn that arrived from direction wi. Zero for
+	// materials that only scatter into single directions, they can't use light samples.
+	virtual vec3 evaluate(const ray& rIn, const hit_record& record, const vec3& wi) const { return vec3(0.f); }
+	// solid angle density scatter() picks wi with, 0 for single direction scattering
+	virtual float pdf(const ray& rIn, const hit_record& record, const vec3& wi) const { return 0.f; }
+	// plain form for MaterialTable, with the texture to look the color up in or nullptr.
+	// Materials that return false are shaded through their virtual functions.
+	virtual bool lower(MaterialRecord& out, const texture*& tex) const { return false; }
 };
 
 class lambertian: public material
@@ -25,6 +146,10 @@ public:
 	lambertian(const vec3&);
 	lambertian(shared_ptr<texture>);
 	virtual bool scatter(const ray& rIn, const hit_record& rec, vec3& attenuation, ray& scattered) const override;
+	bool sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const override;
+	vec3 evaluate(const ray& rIn, const hit_record& record, const vec3& wi) const override;
+	float pdf(const ray& rIn, const hit_record& record, const vec3& wi) const override;
+	bool lower(MaterialRecord& out, const texture*& tex) const override;
 private:
 	shared_ptr<texture> albeo;
 };
@@ -35,9 +160,33 @@ inline lambertian::lambertian(shared_ptr<texture> t): material(), albeo(t) {}
 
 inline bool lambertian::scatter(const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered) const
 {
-	vec3 scatteredDirection = rtnextweek::random_in_hemisphere(record.normal);
-	scattered = ray(record.p, scatteredDirection, rIn.time());
-	attenuation = albeo->value(record.u, record.v, record.p);
+	ScatterRecord s;
+	if (!sample(rIn, record, s)) return false;
+	attenuation = s.weight;
+	scattered = s.scattered;
+	return true;
+}
+
+inline bool lambertian::sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const
+{
+	return bsdf::lambertianSample(albeo->filtered(record.u, record.v, record.p, record.footprint * record.uvScale), rIn, record, out);
+}
+
+inline vec3 lambertian::evaluate(const ray& rIn, const hit_record& record, const vec3& wi) const
+{
+	const float pdf = bsdf::lambertianPdf(record, wi);
+	return pdf > 0.f ? albeo->filtered(record.u, record.v, record.p, record.footprint * record.uvScale) * pdf : vec3(0.f);
+}
+
+inline float lambertian::pdf(const ray& rIn, const hit_record& record, const vec3& wi) const
+{
+	return bsdf::lambertianPdf(record, wi);
+}
+
+inline bool lambertian::lower(MaterialRecord& out, const texture*& tex) const
+{
+	out.type = MaterialType::Lambertian;
+	tex = albeo.get();
 	return true;
 }
 
@@ -46,6 +195,7 @@ class metal: public material
 public:
 	metal(const vec3&);
 	virtual bool scatter(const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered) const override;
+	bool lower(MaterialRecord& out, const texture*& tex) const override;
 protected:
 	vec3 albeo;
 };
@@ -61,47 +211,91 @@ inline bool metal::scatter(const ray& rIn, const hit_record& record, vec3& atten
 	return true;
 }
 
+inline bool metal::lower(MaterialRecord& out, const texture*& tex) const
+{
+	out.type = MaterialType::Metal;
+	out.color = albeo;
+	tex = nullptr;
+	return true;
+}
+
+// Reflections spread over a Phong lobe around the mirror direction. The lobe is the BSDF times
+// cosine, scaled by the albedo, so directions below the surface are absorbed and the rest carry
+// the albedo. The exponent follows from fuzz as 2 / fuzz^2 - 2, fuzz 1 is the whole hemisphere.
 class FuzzyMetal: public metal
 {
 public:
-	FuzzyMetal(const vec3&, double);
+	FuzzyMetal(const vec3&, float);
 	virtual bool scatter(const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered) const override;
+	bool sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const override;
+	vec3 evaluate(const ray& rIn, const hit_record& record, const vec3& wi) const override;
+	float pdf(const ray& rIn, const hit_record& record, const vec3& wi) const override;
+	bool lower(MaterialRecord& out, const texture*& tex) const override;
 protected:
-	double fuzzy;
+	float fuzzy;
+	float exponent;
 };
 
-inline FuzzyMetal::FuzzyMetal(const vec3& color, double f): metal(color), fuzzy(f) {}
+inline FuzzyMetal::FuzzyMetal(const vec3& color, float f): metal(color), fuzzy(std::min(f, 1.f)),
+	exponent(f > 0.f ? 2.f / (fuzzy * fuzzy) - 2.f : 0.f) {}
 
 inline bool FuzzyMetal::scatter(const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered) const
 {
-	vec3 scatteredDirection = rtnextweek::reflect(glm::normalize(rIn.direction()), record.normal);
-	scattered = ray(record.p, scatteredDirection + static_cast<float>(fuzzy) * rtnextweek::random_in_hemisphere(scatteredDirection), rIn.time());
-	attenuation = albeo;
+	ScatterRecord s;
+	if (!sample(rIn, record, s)) return false;
+	attenuation = s.weight;
+	scattered = s.scattered;
+	return true;
+}
+
+inline bool FuzzyMetal::sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const
+{
+	if (fuzzy <= 0.f) return bsdf::mirrorSample(albeo, rIn, record, out);
+	return bsdf::phongSample(albeo, exponent, rIn, record, out);
+}
+
+inline vec3 FuzzyMetal::evaluate(const ray& rIn, const hit_record& record, const vec3& wi) const
+{
+	return fuzzy <= 0.f ? vec3(0.f) : bsdf::phongEvaluate(albeo, exponent, rIn, record, wi);
+}
+
+inline float FuzzyMetal::pdf(const ray& rIn, const hit_record& record, const vec3& wi) const
+{
+	return fuzzy <= 0.f ? 0.f : bsdf::phongPdf(exponent, rIn, record, wi);
+}
+
+inline bool FuzzyMetal::lower(MaterialRecord& out, const texture*& tex) const
+{
+	out.type = fuzzy <= 0.f ? MaterialType::Metal : MaterialType::FuzzyMetal;
+	out.color = albeo;
+	out.param = exponent;
+	tex = nullptr;
 	return true;
 }
 
 class dielectric : public material {
 public:
-	dielectric(double index_of_refraction) : material(), ir(index_of_refraction) {}
+	dielectric(float index_of_refraction) : material(), ir(index_of_refraction) {}
 
 	virtual bool scatter(
 		const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered
 	) const override {
-		attenuation = vec3(1.0, 1.0, 1.0);
-		float refraction_ratio = record.front_face ? (1.0 / ir) : ir;
-		vec3 unit_direction = normalize(rIn.direction());
-		float cos_theta = fmin(dot(-unit_direction, record.normal), 1.0);
-		float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-		bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-		vec3 direction;
-		if (cannot_refract) { direction = rtnextweek::reflect(unit_direction, record.normal); }
-		else { direction = rtnextweek::refract(unit_direction, record.normal, refraction_ratio); }
-		scattered = ray(record.p, direction, rIn.time());
+		ScatterRecord s;
+		bsdf::dielectricSample(ir, rIn, record, s);
+		attenuation = s.weight;
+		scattered = s.scattered;
+		return true;
+	}
+	bool lower(MaterialRecord& out, const texture*& tex) const override
+	{
+		out.type = MaterialType::Dielectric;
+		out.param = ir;
+		tex = nullptr;
 		return true;
 	}
 
 protected:
-	double ir; // Index of Refraction
+	float ir; // Index of Refraction
 };
 
 class DiffuseLight :public material
@@ -117,6 +311,13 @@ public:
 	{
 		return emit->value(u, v, p);
 	}
+	bool isEmissive() const override { return true; }
+	bool lower(MaterialRecord& out, const texture*& tex) const override
+	{
+		out.type = MaterialType::DiffuseLight;
+		tex = emit.get();
+		return true;
+	}
 protected:
 	shared_ptr<texture> emit;
 };
@@ -127,15 +328,34 @@ public:
 	Isotropic(const vec3& c) : albedo(make_shared<solid_color>(c)) {}
 	Isotropic(shared_ptr<texture> a) : albedo(a) {}
 	bool scatter(const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered) const override;
+	bool sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const override;
+	vec3 evaluate(const ray& rIn, const hit_record& record, const vec3& wi) const override
+	{
+		return albedo->filtered(record.u, record.v, record.p, record.footprint * record.uvScale) / (4.f * glm::pi<float>());
+	}
+	float pdf(const ray& rIn, const hit_record& record, const vec3& wi) const override { return 1.f / (4.f * glm::pi<float>()); }
+	bool lower(MaterialRecord& out, const texture*& tex) const override
+	{
+		out.type = MaterialType::Isotropic;
+		tex = albedo.get();
+		return true;
+	}
 protected:
 	shared_ptr<texture> albedo;
 };
 
 inline bool Isotropic::scatter(const ray& rIn, const hit_record& record, vec3& attenuation, ray& scattered) const
 {
-	scattered = ray(record.p ,rtnextweek::random_in_unit_sphere(), rIn.time());
-	attenuation = albedo->value(record.u, record.v, record.p);
+	ScatterRecord s;
+	sample(rIn, record, s);
+	attenuation = s.weight;
+	scattered = s.scattered;
 	return true;
 }
 
+inline bool Isotropic::sample(const ray& rIn, const hit_record& record, ScatterRecord& out) const
+{
+	return bsdf::isotropicSample(albedo->filtered(record.u, record.v, record.p, record.footprint * record.uvScale), rIn, record, out);
+}
+
 #endif
@@ -2,106 +2,215 @@
 #define PERLIN_H_
 
 #include "rtnextweek.h"
+#include "simd.h"
 
+// Perlin noise with random unit gradients. The gradients, split into x, y and z arrays, and the
+// three permutations sit in one cache aligned block inside the object. With AVX2 eight points are
+// evaluated at once, one per lane, gathering the gradients of each of the eight lattice corners;
+// turb() puts its octaves in the lanes, and the batch functions take points eight at a time.
 class perlin
 {
 public:
 	perlin()
 	{
-		ranvec = new vec3[pointCount];
-		for (int i = 0; i < pointCount; ++i) {
-			ranvec[i] = rtnextweek::random_unit_vector();
+		for (int i = 0; i < pointCount; ++i)
+		{
+			const vec3 g = rtnextweek::random_unit_vector();
+			tables.gradX[i] = g.x;
+			tables.gradY[i] = g.y;
+			tables.gradZ[i] = g.z;
 		}
-		permX = perlinGeneratePerm();
-		permY = perlinGeneratePerm();
-		permZ = perlinGeneratePerm();
-	}
-
-	float noise(const glm::vec3& p) const
-	{
-		auto u = p.x - floor(p.x);
-		auto v = p.y - floor(p.y);
-		auto w = p.z - floor(p.z);
-
-		auto i = static_cast<int>(floor(p.x));
-		auto j = static_cast<int>(floor(p.y));
-		auto k = static_cast<int>(floor(p.z));
-		vec3 c[2][2][2];
-
-		for (int di = 0; di < 2; di++)
-			for (int dj = 0; dj < 2; dj++)
-				for (int dk = 0; dk < 2; dk++)
-					c[di][dj][dk] = ranvec[
-						permX[(i + di) & 255] ^
-							permY[(j + dj) & 255] ^
-							permZ[(k + dk) & 255]
-					];
-
-		return perlinInterp(c, u, v, w);
+		perlinGeneratePerm(tables.permX);
+		perlinGeneratePerm(tables.permY);
+		perlinGeneratePerm(tables.permZ);
 	}
 
-	float turb(const vec3& p, int depth = 7) const {
-		auto accum = 0.0;
-		auto temp_p = p;
-		auto weight = 1.0;
-
-		for (int i = 0; i < depth; i++) {
-			accum += weight * noise(temp_p);
-			weight *= 0.5;
-			temp_p *= 2;
-		}
-
-		return fabs(accum);
-	}
-	~perlin()
-	{
-		delete[] ranvec;
-		delete[] permX;
-		delete[] permY;
-		delete[] permZ;
-	}
+	float noise(const glm::vec3& p) const;
+	float turb(const vec3& p, int depth = 7) const;
+	// noise and turb of n points, out[i] for points[i]
+	void noise(const glm::vec3* points, float* out, size_t n) const;
+	void turb(const glm::vec3* points, float* out, size_t n, int depth = 7) const;
 private:
 	static const int pointCount = 256;
-	vec3* ranvec;
-	int* permX;
-	int* permY;
-	int* permZ;
-	static int* perlinGeneratePerm()
+	struct alignas(64) Tables
+	{
+		float gradX[pointCount];
+		float gradY[pointCount];
+		float gradZ[pointCount];
+		int32_t permX[pointCount];
+		int32_t permY[pointCount];
+		int32_t permZ[pointCount];
+	};
+	Tables tables;
+
+	static void perlinGeneratePerm(int32_t* p)
 	{
-		auto p = new int[pointCount];
 		for (int i = 0; i < pointCount; ++i)
 			p[i] = i;
 		permute(p, pointCount);
-		return p;
 	}
-	static void permute(int* p, int n)
+	static void permute(int32_t* p, int n)
 	{
 		for(int i = n-1; i >0; --i)
 		{
 			int  target = rtnextweek::random_int(0, i);
-			int tmp = p[i];
+			int32_t tmp = p[i];
 			p[i] = p[target];
 			p[target] = tmp;
 		}
 	}
-	static float perlinInterp(vec3 c[2][2][2], float u, float v, float w) {
-		auto uu = u * u * (3 - 2 * u);
-		auto vv = v * v * (3 - 2 * v);
-		auto ww = w * w * (3 - 2 * w);
-		auto accum = 0.0;
+#if RTNW_AVX2
+	// noise at eight points, one per lane
+	__m256 noise8(__m256 x, __m256 y, __m256 z) const;
+#endif
+};
 
-		for (int i = 0; i < 2; i++)
-			for (int j = 0; j < 2; j++)
-				for (int k = 0; k < 2; k++) {
-					vec3 weight_v(u - i, v - j, w - k);
-					accum += (i * uu + (1 - i) * (1 - uu))
-						* (j * vv + (1 - j) * (1 - vv))
-						* (k * ww + (1 - k) * (1 - ww))
-						* glm::dot(c[i][j][k], weight_v);
-				}
+inline float perlin::noise(const glm::vec3& p) const
+{
+	const float fx = std::floor(p.x), fy = std::floor(p.y), fz = std::floor(p.z);
+	const float u = p.x - fx, v = p.y - fy, w = p.z - fz;
+	const int i = static_cast<int>(fx), j = static_cast<int>(fy), k = static_cast<int>(fz);
+	const float uu = u * u * (3 - 2 * u);
+	const float vv = v * v * (3 - 2 * v);
+	const float ww = w * w * (3 - 2 * w);
 
-		return accum;
+	// blend along z, then y, then x
+	float acrossX[2];
+	for (int di = 0; di < 2; di++)
+	{
+		float acrossY[2];
+		const int32_t px = tables.permX[(i + di) & 255];
+		for (int dj = 0; dj < 2; dj++)
+		{
+			const int32_t pxy = px ^ tables.permY[(j + dj) & 255];
+			float corner[2];
+			for (int dk = 0; dk < 2; dk++)
+			{
+				const int32_t h = pxy ^ tables.permZ[(k + dk) & 255];
+				corner[dk] = tables.gradX[h] * (u - di) + tables.gradY[h] * (v - dj) + tables.gradZ[h] * (w - dk);
+			}
+			acrossY[dj] = corner[0] + ww * (corner[1] - corner[0]);
+		}
+		acrossX[di] = acrossY[0] + vv * (acrossY[1] - acrossY[0]);
 	}
-};
+	return acrossX[0] + uu * (acrossX[1] - acrossX[0]);
+}
+
+#if RTNW_AVX2
+inline __m256 perlin::noise8(__m256 x, __m256 y, __m256 z) const
+{
+	const __m256 fx = _mm256_floor_ps(x), fy = _mm256_floor_ps(y), fz = _mm256_floor_ps(z);
+	const __m256 u = _mm256_sub_ps(x, fx), v = _mm256_sub_ps(y, fy), w = _mm256_sub_ps(z, fz);
+	const __m256i mask = _mm256_set1_epi32(255), one = _mm256_set1_epi32(1);
+	const __m256i i = _mm256_cvttps_epi32(fx), j = _mm256_cvttps_epi32(fy), k = _mm256_cvttps_epi32(fz);
+	// the permutation entries of both lattice planes along each axis
+	const __m256i px[2] = { _mm256_i32gather_epi32(tables.permX, _mm256_and_si256(i, mask), 4),
+		_mm256_i32gather_epi32(tables.permX, _mm256_and_si256(_mm256_add_epi32(i, one), mask), 4) };
+	const __m256i py[2] = { _mm256_i32gather_epi32(tables.permY, _mm256_and_si256(j, mask), 4),
+		_mm256_i32gather_epi32(tables.permY, _mm256_and_si256(_mm256_add_epi32(j, one), mask), 4) };
+	const __m256i pz[2] = { _mm256_i32gather_epi32(tables.permZ, _mm256_and_si256(k, mask), 4),
+		_mm256_i32gather_epi32(tables.permZ, _mm256_and_si256(_mm256_add_epi32(k, one), mask), 4) };
+
+	const __m256 three = _mm256_set1_ps(3.f), two = _mm256_set1_ps(2.f), oneF = _mm256_set1_ps(1.f);
+	auto fade = [&](__m256 t) { return _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(three, _mm256_mul_ps(two, t))); };
+	const __m256 uu = fade(u), vv = fade(v), ww = fade(w);
+	const __m256 du[2] = { u, _mm256_sub_ps(u, oneF) };
+	const __m256 dv[2] = { v, _mm256_sub_ps(v, oneF) };
+	const __m256 dw[2] = { w, _mm256_sub_ps(w, oneF) };
+	auto lerp = [](__m256 a, __m256 b, __m256 t) { return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a))); };
+
+	__m256 acrossX[2];
+	for (int di = 0; di < 2; di++)
+	{
+		__m256 acrossY[2];
+		for (int dj = 0; dj < 2; dj++)
+		{
+			const __m256i pxy = _mm256_xor_si256(px[di], py[dj]);
+			__m256 corner[2];
+			for (int dk = 0; dk < 2; dk++)
+			{
+				const __m256i h = _mm256_xor_si256(pxy, pz[dk]);
+				const __m256 gx = _mm256_i32gather_ps(tables.gradX, h, 4);
+				const __m256 gy = _mm256_i32gather_ps(tables.gradY, h, 4);
+				const __m256 gz = _mm256_i32gather_ps(tables.gradZ, h, 4);
+				corner[dk] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gx, du[di]), _mm256_mul_ps(gy, dv[dj])), _mm256_mul_ps(gz, dw[dk]));
+			}
+			acrossY[dj] = lerp(corner[0], corner[1], ww);
+		}
+		acrossX[di] = lerp(acrossY[0], acrossY[1], vv);
+	}
+	return lerp(acrossX[0], acrossX[1], uu);
+}
+#endif
+
+inline float perlin::turb(const vec3& p, int depth) const
+{
+	float accum = 0.f;
+#if RTNW_AVX2
+	// eight octaves per call, lane i at p * 2^i weighted by 2^-i
+	const __m256 octave = _mm256_setr_ps(1.f, 2.f, 4.f, 8.f, 16.f, 32.f, 64.f, 128.f);
+	const __m256 weight = _mm256_setr_ps(1.f, .5f, .25f, .125f, .0625f, .03125f, .015625f, .0078125f);
+	float scale = 1.f;
+	for (int first = 0; first < depth; first += 8)
+	{
+		const __m256 s = _mm256_mul_ps(octave, _mm256_set1_ps(scale));
+		const __m256 n = noise8(_mm256_mul_ps(_mm256_set1_ps(p.x), s), _mm256_mul_ps(_mm256_set1_ps(p.y), s), _mm256_mul_ps(_mm256_set1_ps(p.z), s));
+		alignas(32) float lanes[8];
+		_mm256_store_ps(lanes, _mm256_mul_ps(n, weight));
+		const int count = std::min(depth - first, 8);
+		for (int i = 0; i < count; i++) accum += lanes[i] / scale;
+		scale *= 256.f;
+	}
+#else
+	vec3 temp_p = p;
+	float weight = 1.f;
+	for (int i = 0; i < depth; i++) {
+		accum += weight * noise(temp_p);
+		weight *= 0.5f;
+		temp_p *= 2;
+	}
+#endif
+	return std::fabs(accum);
+}
+
+inline void perlin::noise(const glm::vec3* points, float* out, size_t n) const
+{
+	size_t i = 0;
+#if RTNW_AVX2
+	for (; i + 8 <= n; i += 8)
+	{
+		alignas(32) float x[8], y[8], z[8];
+		for (int l = 0; l < 8; l++) x[l] = points[i + l].x, y[l] = points[i + l].y, z[l] = points[i + l].z;
+		_mm256_storeu_ps(out + i, noise8(_mm256_load_ps(x), _mm256_load_ps(y), _mm256_load_ps(z)));
+	}
+#endif
+	for (; i < n; i++) out[i] = noise(points[i]);
+}
+
+inline void perlin::turb(const glm::vec3* points, float* out, size_t n, int depth) const
+{
+	size_t i = 0;
+#if RTNW_AVX2
+	for (; i + 8 <= n; i += 8)
+	{
+		alignas(32) float x[8], y[8], z[8];
+		for (int l = 0; l < 8; l++) x[l] = points[i + l].x, y[l] = points[i + l].y, z[l] = points[i + l].z;
+		__m256 px = _mm256_load_ps(x), py = _mm256_load_ps(y), pz = _mm256_load_ps(z);
+		__m256 accum = _mm256_setzero_ps();
+		float weight = 1.f;
+		for (int octave = 0; octave < depth; octave++)
+		{
+			accum = _mm256_add_ps(accum, _mm256_mul_ps(_mm256_set1_ps(weight), noise8(px, py, pz)));
+			weight *= .5f;
+			px = _mm256_add_ps(px, px);
+			py = _mm256_add_ps(py, py);
+			pz = _mm256_add_ps(pz, pz);
+		}
+		// clear the sign bit for the absolute value
+		_mm256_storeu_ps(out + i, _mm256_andnot_ps(_mm256_set1_ps(-0.f), accum));
+	}
+#endif
+	for (; i < n; i++) out[i] = turb(points[i], depth);
+}
 
-#endif
\ No newline at end of file
+#endif
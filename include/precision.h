@@ -0,0 +1,16 @@
+#ifndef PRECISION_H_
+#define PRECISION_H_
+
+// Scalar type of the tracing interfaces: ray distances, hit record t, sphere radii and the
+// camera's screen sizes. Single precision by default so the hot loops never convert between
+// float and double. RTNW_DOUBLE_PRECISION makes only these scalars double: ray origins and
+// directions, hit points, normals and vertices stay glm::vec3, and ray::at rounds back to float.
+// It steadies the root solving of large spheres and long t ranges, not the placement of points
+// far from the origin.
+#ifdef RTNW_DOUBLE_PRECISION
+using real = double;
+#else
+using real = float;
+#endif
+
+#endif
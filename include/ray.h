@@ -2,6 +2,7 @@
 #define RAY_H
 
 #include "glm/glm.hpp"
+#include "precision.h"
 
 class ray {
 public:
@@ -14,8 +15,9 @@ public:
     glm::vec3 direction() const { return dir; }
     float time() const { return tm; }
 
-    glm::vec3 at(float t) const {
-        return orig + dir * t;
+    glm::vec3 at(real t) const {
+        // positions are stored in float whatever the distance precision
+        return orig + dir * static_cast<float>(t);
     }
 
 private:
@@ -1,4 +1,8 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <random>
 #include "glm/glm.hpp"
 #include "aabb.h"
@@ -7,9 +11,55 @@
 
 namespace rtnextweek
 {
+    // PCG32 (O'Neill 2014). One per thread drives every random function below; the sampling
+    // ones run on every bounce and must neither share the lock inside rand() nor loop on
+    // rejection.
+    class Pcg32 {
+    public:
+        explicit Pcg32(uint64_t seed, uint64_t stream = 1) : state(0), increment((stream << 1) | 1) {
+            next();
+            state += seed;
+            next();
+        }
+        uint32_t next() {
+            const uint64_t old = state;
+            state = old * 6364136223846793005ull + increment;
+            const uint32_t shifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+            const uint32_t rotation = static_cast<uint32_t>(old >> 59);
+            return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+        }
+        // [0,1) from the top 24 bits, every value exactly representable
+        float uniform() { return static_cast<float>(next() >> 8) * (1.f / 16777216.f); }
+        // [0,1) with the 53 bits of a double, from two draws
+        double uniformDouble() {
+            const uint64_t high = next() >> 5;
+            const uint64_t low = next() >> 6;
+            return static_cast<double>((high << 26) | low) * (1.0 / 9007199254740992.0);
+        }
+    private:
+        uint64_t state;
+        uint64_t increment;
+    };
+
+    // the calling thread's generator, each thread on its own stream
+    inline Pcg32& sampler() {
+        static std::atomic<uint64_t> streams{ 0 };
+        thread_local Pcg32 generator(0x853c49e6748fea9bull, streams++);
+        return generator;
+    }
+
+    inline float random_float() {
+        return sampler().uniform();
+    }
+
+    inline float random_float(float min, float max) {
+        // Returns a random real in [min,max).
+        return min + (max - min) * random_float();
+    }
+
     inline double random_double() {
         // Returns a random real in [0,1).
-        return rand() / (RAND_MAX + 1.0);
+        return sampler().uniformDouble();
     }
 
     inline double random_double(double min, double max) {
@@ -22,24 +72,80 @@ namespace rtnextweek
         return static_cast<int>(random_double(min, max + 1));
     }
 
-    glm::vec3 random_in_unit_sphere() {
-        while (true) {
-            auto p = glm::vec3(random_double(-1.0, 1.0), random_double(-1.0, 1.0), random_double(-1.0, 1.0));
-            if (length(p) >= 1) continue;
-            return p;
-        }
+    // Closed form maps from uniforms in [0,1) to the shapes, straight-line code without
+    // rejection so a loop over a batch of samples vectorizes.
+
+    // concentric map of the square onto the disk (Shirley and Chiu 1997), z = 0
+    inline glm::vec3 sample_unit_disk(float u1, float u2) {
+        const float a = 2.f * u1 - 1.f;
+        const float b = 2.f * u2 - 1.f;
+        const bool major = std::fabs(a) > std::fabs(b);
+        const float r = major ? a : b;
+        const float num = major ? b : a;
+        const float den = r != 0.f ? r : 1.f;
+        const float phi = major ? .78539816f * (num / den) : 1.57079633f - .78539816f * (num / den);
+        return glm::vec3(r * std::cos(phi), r * std::sin(phi), 0.f);
     }
 
-    glm::vec3 random_unit_vector() {
-        return normalize(random_in_unit_sphere());
+    inline glm::vec3 sample_unit_vector(float u1, float u2) {
+        const float z = 1.f - 2.f * u1;
+        const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+        const float phi = 6.28318531f * u2;
+        return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
     }
 
-    glm::vec3 random_in_hemisphere(const glm::vec3& normal) {
-        glm::vec3 in_unit_sphere = random_in_unit_sphere();
-        if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-            return in_unit_sphere;
-        else
-            return -in_unit_sphere;
+    // uniform in the ball: a direction scaled by the cube root of the volume fraction
+    inline glm::vec3 sample_unit_ball(float u1, float u2, float u3) {
+        return std::cbrt(u3) * sample_unit_vector(u1, u2);
+    }
+
+    inline glm::vec3 random_in_unit_sphere() {
+        const float u1 = random_float();
+        const float u2 = random_float();
+        const float u3 = random_float();
+        return sample_unit_ball(u1, u2, u3);
+    }
+
+    inline glm::vec3 random_unit_vector() {
+        const float u1 = random_float();
+        const float u2 = random_float();
+        return sample_unit_vector(u1, u2);
+    }
+
+    inline glm::vec3 random_in_hemisphere(const glm::vec3& normal) {
+        // mirrored into the normal's side rather than redrawn
+        const glm::vec3 p = random_in_unit_sphere();
+        return std::copysign(1.f, dot(p, normal)) * p;
+    }
+
+    // tangents completing the unit vector n to an orthonormal basis (Duff et al. 2017)
+    inline void orthonormal_basis(const glm::vec3& n, glm::vec3& t, glm::vec3& b) {
+        const float sign = std::copysign(1.f, n.z);
+        const float a = -1.f / (sign + n.z);
+        const float c = n.x * n.y * a;
+        t = glm::vec3(1.f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+        b = glm::vec3(c, sign + n.y * n.y * a, -n.y);
+    }
+
+    // direction about the unit vector n with density cos(theta) / pi
+    inline glm::vec3 random_cosine_direction(const glm::vec3& n) {
+        // a point on the disk lifted onto the hemisphere (Malley's method)
+        const float u1 = random_float();
+        const float u2 = random_float();
+        const glm::vec3 d = sample_unit_disk(u1, u2);
+        glm::vec3 t, b;
+        orthonormal_basis(n, t, b);
+        return d.x * t + d.y * b + std::sqrt(std::max(0.f, 1.f - d.x * d.x - d.y * d.y)) * n;
+    }
+
+    // direction about the unit vector axis with density (exponent + 1) / (2 pi) * cos(theta)^exponent
+    inline glm::vec3 random_phong_direction(const glm::vec3& axis, float exponent) {
+        const float cosTheta = std::pow(random_float(), 1.f / (exponent + 1.f));
+        const float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+        const float phi = 6.28318531f * random_float();
+        glm::vec3 t, b;
+        orthonormal_basis(axis, t, b);
+        return sinTheta * std::cos(phi) * t + sinTheta * std::sin(phi) * b + cosTheta * axis;
     }
 
     glm::vec3 reflect(const glm::vec3& v, const glm::vec3& n)
@@ -54,11 +160,9 @@ namespace rtnextweek
         return r_out_perp + r_out_parallel;
     }
 
-    glm::vec3 random_in_unit_disk() {
-        while (true) {
-            auto p = glm::vec3(random_double(-1, 1), random_double(-1, 1), 0);
-            if (glm::dot(p, p) >= 1) continue;
-            return p;
-        }
+    inline glm::vec3 random_in_unit_disk() {
+        const float u1 = random_float();
+        const float u2 = random_float();
+        return sample_unit_disk(u1, u2);
     }
 }
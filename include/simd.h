@@ -0,0 +1,77 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RTNW_AVX2 1
+#else
+#define RTNW_AVX2 0
+#endif
+
+namespace rtnextweek
+{
+	// number of lanes the packet kernels are laid out for, whether or not AVX2 is enabled
+	constexpr uint32_t simdWidth = 8;
+	constexpr size_t simdAlignment = 32;
+
+	template <class T, size_t Alignment = simdAlignment>
+	class AlignedAllocator
+	{
+	public:
+		using value_type = T;
+		template <class U> struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+		AlignedAllocator() = default;
+		template <class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+		T* allocate(size_t n)
+		{
+			void* p = ::operator new(n * sizeof(T), std::align_val_t(Alignment));
+			return static_cast<T*>(p);
+		}
+		void deallocate(T* p, size_t)
+		{
+			::operator delete(p, std::align_val_t(Alignment));
+		}
+		template <class U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+		template <class U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+	};
+
+	template <class T>
+	using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+	inline uint32_t roundUp(uint32_t n, uint32_t multiple)
+	{
+		return (n + multiple - 1) / multiple * multiple;
+	}
+
+#if RTNW_AVX2
+	// index of the smallest lane of t among the lanes set in mask, or -1 when the mask is empty
+	inline int minLane(__m256 t, __m256 mask, float& tMin)
+	{
+		if (_mm256_movemask_ps(mask) == 0) return -1;
+		__m256 v = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), t, mask);
+		__m256 m = _mm256_min_ps(v, _mm256_permute2f128_ps(v, v, 1));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		const int lanes = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(v, m, _CMP_EQ_OQ), mask));
+		tMin = _mm256_cvtss_f32(m);
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, static_cast<unsigned long>(lanes));
+		return static_cast<int>(index);
+#else
+		return __builtin_ctz(static_cast<unsigned>(lanes));
+#endif
+	}
+#endif
+}
+
+#endif
@@ -4,6 +4,8 @@
 #include "rtnextweek.h"
 #include <memory>
 #include "perlin.h"
+#include "NoiseVolume.h"
+#include "TextureCache.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -11,6 +13,11 @@ class texture
 {
 public:
 	virtual vec3 value(float u, float v, const vec3& p) const = 0;
+	// value averaged over a footprint about width wide in uv, textures without detail to lose
+	// just return value()
+	virtual vec3 filtered(float u, float v, const vec3& p, float width) const { return value(u, v, p); }
+	// true with the color for textures that are the same everywhere
+	virtual bool constant(vec3& color) const { return false; }
 };
 
 class solid_color : public texture
@@ -20,6 +27,11 @@ public:
 	solid_color(const vec3& c) : color_value(c) {}
 	solid_color(float r, float g, float b) : solid_color(vec3(r, g, b)) {}
 	vec3 value(float u, float v, const vec3& p) const override { return color_value; };
+	bool constant(vec3& color) const override
+	{
+		color = color_value;
+		return true;
+	}
 private:
 	vec3 color_value;
 };
@@ -43,6 +55,11 @@ public:
             return even->value(u, v, p);
     }
 
+    vec3 filtered(float u, float v, const vec3& p, float width) const override {
+        auto sines = sin(10 * p.x) * sin(10 * p.y) * sin(10 * p.z);
+        return (sines < 0 ? odd : even)->filtered(u, v, p, width);
+    }
+
 public:
     shared_ptr<texture> odd;
     shared_ptr<texture> even;
@@ -55,54 +72,242 @@ public:
     NoiseTexture() : NoiseTexture(1.f) {}
     vec3 value(float u, float v, const vec3& p) const override
     {
-        return vec3(1, 1, 1) * 0.5f * (1 + sin(scale * p.z + 10 * noise.turb(p)));
+        float turbulence;
+        if (!baked || !baked->lookup(p, turbulence)) turbulence = noise.turb(p);
+        else if (const float w = baked->interior(p); w < 1.f)
+        {
+            const float exact = noise.turb(p);
+            turbulence = exact + w * (turbulence - exact);
+        }
+        return vec3(1, 1, 1) * 0.5f * (1 + sin(scale * p.z + 10 * turbulence));
+    }
+    // samples the turbulence over bounds once, later lookups inside bounds interpolate it and
+    // the rest are computed as before, fading between the two near the faces of bounds.
+    // Baking the same bounds and resolution again reuses it.
+    const NoiseVolume& bake(const aabb& bounds, int resolution)
+    {
+        if (!baked || baked->resolution() != resolution || baked->bounds().min() != bounds.min() || baked->bounds().max() != bounds.max())
+            baked = std::make_unique<NoiseVolume>(noise, bounds, resolution);
+        return *baked;
     }
+    const NoiseVolume* volume() const { return baked.get(); }
 private:
     perlin noise;
     float scale;
+    std::unique_ptr<NoiseVolume> baked;
 };
 
+// Image stored as a mip pyramid for filtered lookups. Every level is cut into 64x64 texel pages
+// of 8x8 texel tiles laid out one after another, so the texels a bilinear lookup needs are
+// almost always in the same few cache lines, and lookups with a wide footprint read small
+// levels that stay cached. When the TextureCache has a budget the pages are handed to it and
+// only the ones lookups touch are in memory.
 class ImageTexture :public texture
 {
 public:
     const static int bytesPerPixel = 3;
-    ImageTexture() :
-        width(0), height(0), data(nullptr), bytesPerScanLine(0) {}
-	ImageTexture(const char* filePath):
-        width(0), height(0),
-		data(stbi_load(
-            filePath, &width, &height, &channels, bytesPerPixel)),
-		bytesPerScanLine(bytesPerPixel * width)
-    {
-	    if(data == nullptr)
-	    {
+    const static int tileSize = 8;
+    ImageTexture() {}
+	ImageTexture(const char* filePath): ImageTexture()
+    {
+        load(filePath);
+    }
+    // from rows of RGB8 pixels, top row first
+    ImageTexture(const unsigned char* pixels, int width, int height)
+    {
+        build(pixels, width, height);
+    }
+    ImageTexture(const ImageTexture&) = delete;
+    ImageTexture& operator=(const ImageTexture&) = delete;
+    // decodes the file into this texture, replacing what it held. Textures that are not
+    // shared yet may be loaded from different threads at the same time.
+    bool load(const char* filePath)
+    {
+        int width, height, channels;
+        unsigned char* data = stbi_load(filePath, &width, &height, &channels, bytesPerPixel);
+        if (data == nullptr)
+        {
             std::cerr << "ERROR: Could not load texture image file '" << filePath << "'.\n";
-            width = height = 0;
-	    }
+            clear();
+            return false;
+        }
+        build(data, width, height);
+        stbi_image_free(data);
+        return true;
     }
-    ~ImageTexture()
+    // the same from an encoded image already in memory, a PNG or JPEG file's bytes
+    bool load(const unsigned char* encoded, size_t size)
     {
-        delete data;
+        int width, height, channels;
+        unsigned char* data = stbi_load_from_memory(encoded, static_cast<int>(size), &width, &height, &channels, bytesPerPixel);
+        if (data == nullptr)
+        {
+            clear();
+            return false;
+        }
+        build(data, width, height);
+        stbi_image_free(data);
+        return true;
     }
+    // bilinear on the full resolution image
     virtual vec3 value(float u, float v, const vec3& p) const override
     {
-        if (data == nullptr) return vec3(0.f, 1.f, 1.f);
-        u = clamp(u, 0.f, 1.f);
-        v = 1.f - clamp(v, 0.f, 1.f);
-
-        auto i = static_cast<int>(u * width);
-        auto j = static_cast<int>(v * height);
+        if (levels.empty()) return vec3(0.f, 1.f, 1.f);
+        return bilinear(levels[0], u, v);
+    }
+    // trilinear between the two levels whose texels are closest to width in size
+    vec3 filtered(float u, float v, const vec3& p, float width) const override
+    {
+        if (levels.empty()) return vec3(0.f, 1.f, 1.f);
+        const float texelsAcross = width * static_cast<float>(std::max(levels[0].width, levels[0].height));
+        const float lod = glm::clamp(std::log2(std::max(texelsAcross, 1.f)), 0.f, static_cast<float>(levels.size() - 1));
+        const size_t fine = static_cast<size_t>(lod);
+        const float blend = lod - static_cast<float>(fine);
+        if (blend <= 0.f || fine + 1 >= levels.size()) return bilinear(levels[fine], u, v);
+        return glm::mix(bilinear(levels[fine], u, v), bilinear(levels[fine + 1], u, v), blend);
+    }
+    size_t levelCount() const { return levels.size(); }
 
-        const auto colorScale = 1.f / 255.f;
-        auto pixel = data + j * bytesPerScanLine + i * bytesPerPixel;
-        return vec3(colorScale * pixel[0], colorScale * pixel[1], colorScale * pixel[2]);
+    // levels are cut into pages of TextureCache::pageTexels square, pages into tiles
+    static const int pageSize = TextureCache::pageTexels;
+    static const size_t pageBytes = TextureCache::pageBytes;
+    struct Level
+    {
+        int width;
+        int height;
+        int pagesX;
+        uint32_t firstPage;     // pages of a level follow each other row by row
+    };
+    const std::vector<Level>& mipLevels() const { return levels; }
+    uint32_t pageCount() const { return pages; }
+    // all pages one after another, nullptr when they went to the TextureCache
+    const unsigned char* pageData() const { return pageMemory; }
+    // copies page i to out, pageBytes bytes, wherever the pages are kept
+    void readPage(uint32_t i, unsigned char* out) const
+    {
+        if (paged) TextureCache::global().read(*paged, i, 0, out, pageBytes);
+        else std::copy_n(pageMemory + i * pageBytes, pageBytes, out);
     }
+    // looks up texels in pages laid out like pageData(), which owner keeps alive. With a
+    // TextureCache budget they are copied into the cache instead.
+    void adopt(std::vector<Level> pyramid, const unsigned char* data, std::shared_ptr<const void> owner);
 private:
-    int width;
-    int height;
-    unsigned char* data;
-    int bytesPerScanLine;
-    int channels;
+    // tiles and downsamples rows of RGB8 pixels
+    void build(const unsigned char* pixels, int width, int height);
+    void clear()
+    {
+        levels.clear();
+        pages = 0;
+        pageMemory = nullptr;
+        pageOwner.reset();
+        paged.reset();
+    }
+    static uint32_t pageOf(const Level& level, int x, int y)
+    {
+        return level.firstPage + static_cast<unsigned>(y) / pageSize * static_cast<unsigned>(level.pagesX) + static_cast<unsigned>(x) / pageSize;
+    }
+    static size_t offsetInPage(int x, int y)
+    {
+        // coordinates are never negative, unsigned lets the divisions become shifts
+        const unsigned ux = static_cast<unsigned>(x) % pageSize, uy = static_cast<unsigned>(y) % pageSize;
+        const size_t tile = (uy / tileSize) * (pageSize / tileSize) + ux / tileSize;
+        const size_t inTile = (uy % tileSize) * tileSize + ux % tileSize;
+        return (tile * tileSize * tileSize + inTile) * bytesPerPixel;
+    }
+    void texel(const Level& level, int x, int y, unsigned char* rgb) const
+    {
+        const uint32_t page = pageOf(level, x, y);
+        if (paged) TextureCache::global().read(*paged, page, offsetInPage(x, y), rgb, bytesPerPixel);
+        else std::copy_n(pageMemory + page * pageBytes + offsetInPage(x, y), bytesPerPixel, rgb);
+    }
+    vec3 bilinear(const Level& level, float u, float v) const;
+
+    std::vector<Level> levels;
+    uint32_t pages = 0;
+    const unsigned char* pageMemory = nullptr;
+    std::shared_ptr<const void> pageOwner;          // a vector of the pages or a file mapping them
+    std::unique_ptr<TextureCache::Image> paged;
 };
 
+inline void ImageTexture::build(const unsigned char* pixels, int width, int height)
+{
+    clear();
+    std::vector<Level> pyramid;
+    auto texels = std::make_shared<std::vector<unsigned char>>();
+    std::vector<unsigned char> current(pixels, pixels + static_cast<size_t>(width) * height * bytesPerPixel), next;
+    uint32_t pageCount = 0;
+    while (true)
+    {
+        Level level = { width, height, (width + pageSize - 1) / pageSize, pageCount };
+        pageCount += static_cast<uint32_t>(level.pagesX * ((height + pageSize - 1) / pageSize));
+        texels->resize(pageCount * pageBytes);
+        pyramid.push_back(level);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                std::copy_n(&current[(static_cast<size_t>(y) * width + x) * bytesPerPixel], bytesPerPixel,
+                    &(*texels)[pageOf(level, x, y) * pageBytes + offsetInPage(x, y)]);
+        if (width == 1 && height == 1) break;
+
+        // 2x2 box filter, odd edges reuse their last row or column
+        const int nextWidth = std::max(1, width / 2), nextHeight = std::max(1, height / 2);
+        next.assign(static_cast<size_t>(nextWidth) * nextHeight * bytesPerPixel, 0);
+        for (int y = 0; y < nextHeight; y++)
+            for (int x = 0; x < nextWidth; x++)
+                for (int c = 0; c < bytesPerPixel; c++)
+                {
+                    const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                    const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+                    auto at = [&](int px, int py) { return current[(static_cast<size_t>(py) * width + px) * bytesPerPixel + c]; };
+                    next[(static_cast<size_t>(y) * nextWidth + x) * bytesPerPixel + c] =
+                        static_cast<unsigned char>((at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1) + 2) / 4);
+                }
+        current.swap(next);
+        width = nextWidth;
+        height = nextHeight;
+    }
+    const unsigned char* data = texels->data();
+    adopt(std::move(pyramid), data, std::move(texels));
+}
+
+inline void ImageTexture::adopt(std::vector<Level> pyramid, const unsigned char* data, std::shared_ptr<const void> owner)
+{
+    clear();
+    if (pyramid.empty()) return;
+    const Level& last = pyramid.back();
+    pages = last.firstPage + static_cast<uint32_t>(last.pagesX * ((last.height + pageSize - 1) / pageSize));
+    levels = std::move(pyramid);
+    // with a cache budget the pages live in the cache and are read back when lookups need them
+    if (TextureCache::global().enabled())
+    {
+        auto image = std::make_unique<TextureCache::Image>();
+        if (TextureCache::global().add(*image, data, pages))
+        {
+            paged = std::move(image);
+            return;
+        }
+    }
+    pageMemory = data;
+    pageOwner = std::move(owner);
+}
+
+inline vec3 ImageTexture::bilinear(const Level& level, float u, float v) const
+{
+    // texel centers at half integers, v runs up the image
+    const float x = clamp(u, 0.f, 1.f) * level.width - .5f;
+    const float y = (1.f - clamp(v, 0.f, 1.f)) * level.height - .5f;
+    const float fx = std::floor(x), fy = std::floor(y);
+    const float tx = x - fx, ty = y - fy;
+    const int x0 = std::max(static_cast<int>(fx), 0), x1 = std::min(static_cast<int>(fx) + 1, level.width - 1);
+    const int y0 = std::max(static_cast<int>(fy), 0), y1 = std::min(static_cast<int>(fy) + 1, level.height - 1);
+    auto rgb = [&](int x, int y)
+    {
+        unsigned char t[bytesPerPixel];
+        texel(level, x, y, t);
+        return vec3(t[0], t[1], t[2]);
+    };
+    const vec3 color = (1.f - ty) * ((1.f - tx) * rgb(x0, y0) + tx * rgb(x1, y0)) + ty * ((1.f - tx) * rgb(x0, y1) + tx * rgb(x1, y1));
+    const auto colorScale = 1.f / 255.f;
+    return colorScale * color;
+}
+
 #endif // !TEXTURE_H_
\ No newline at end of file
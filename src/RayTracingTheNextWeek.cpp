@@ -2,6 +2,8 @@
 //
 #include <iostream>
 #include <string>
+#include <chrono>
+#include <filesystem>
 #include "glad/glad.h"
 #include "glm/glm.hpp"
 #include "Window.h"
@@ -14,6 +16,15 @@
 #include "bvh.h"
 #include "texture.h"
 #include "ConstantMedium.h"
+#include "SphereSet.h"
+#include "MeshFile.h"
+#include "ObjLoader.h"
+#include "CompiledScene.h"
+#include "Arena.h"
+#include "StressScene.h"
+#include "SceneFile.h"
+#include "Integrator.h"
+#include "TextureRegistry.h"
 using namespace std;
 using namespace hdgbdn;
 
@@ -21,9 +32,9 @@ using namespace hdgbdn;
 const string APP_NAME = "Ray Tracing The Next Week";
 const int window_width = 300;
 const int window_height = 300;
-const double infinity = std::numeric_limits<double>::infinity();
 const int samples = 50;
 const int ray_depth = 50;
+const int texture_cache_mb = 0;		// 0 keeps image textures resident
 const float gamma = 1.f;
 const float exposure = 3.0f;
 
@@ -46,12 +57,13 @@ void sendTexture(void* data)
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, window_width, window_height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
 }
 
-hittable_list random_scene() {
+hittable_list random_scene(Arena& arena) {
 	hittable_list world;
 
-	auto checker_tex = make_shared<checker_texture>(vec3(0.2, 0.3, 0.1), vec3(0.9, 0.9, 0.9));
-	auto ground_material = make_shared<lambertian>(checker_tex);
-	world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, ground_material));
+	auto checker_tex = arena.make<checker_texture>(vec3(0.2, 0.3, 0.1), vec3(0.9, 0.9, 0.9));
+	auto ground_material = arena.make<lambertian>(checker_tex);
+	world.add(arena.make<Plane>(vec3(0, 0, 0), vec3(0, 1, 0), ground_material));
+	auto spheres = arena.make<SphereSet>();
 
 	for (int a = -11; a < 11; a++) {
 		for (int b = -11; b < 11; b++) {
@@ -64,106 +76,118 @@ hittable_list random_scene() {
 				if (choose_mat < 0.8) {
 					// diffuse
 					auto albedo = vec3(rtnextweek::random_double(), rtnextweek::random_double(), rtnextweek::random_double());
-					sphere_material = make_shared<lambertian>(albedo);
+					sphere_material = arena.make<lambertian>(albedo);
 					glm::vec3 center2 = center + vec3(0, rtnextweek::random_double(0, .5), 0);
-					world.add(make_shared<movingsphere>(center, center2, 0.f, 1.f, 0.2, sphere_material));
+					world.add(arena.make<movingsphere>(center, center2, 0.f, 1.f, 0.2, sphere_material));
 				}
 				else if (choose_mat < 0.95) {
 					// metal
 					auto albedo = vec3(rtnextweek::random_double(0.5, 1.0), rtnextweek::random_double(0.5, 1.0), rtnextweek::random_double(0.5, 1.0));
 					auto fuzz = rtnextweek::random_double(0, 0.5);
-					sphere_material = make_shared<FuzzyMetal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = arena.make<FuzzyMetal>(albedo, fuzz);
+					spheres->add(center, 0.2f, sphere_material);
 				}
 				else {
 					// glass
-					sphere_material = make_shared<dielectric>(1.5);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = arena.make<dielectric>(1.5);
+					spheres->add(center, 0.2f, sphere_material);
 				}
 			}
 		}
 	}
 
-	auto material1 = make_shared<dielectric>(1.5);
-	world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
+	auto material1 = arena.make<dielectric>(1.5);
+	spheres->add(vec3(0, 1, 0), 1.f, material1);
 
-	auto material2 = make_shared<lambertian>(vec3(0.4, 0.2, 0.1));
-	world.add(make_shared<sphere>(vec3(-4, 1, 0), 1.0, material2));
+	auto material2 = arena.make<lambertian>(vec3(0.4, 0.2, 0.1));
+	spheres->add(vec3(-4, 1, 0), 1.f, material2);
 
-	auto material3 = make_shared<metal>(vec3(0.7, 0.6, 0.5));
-	world.add(make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+	auto material3 = arena.make<metal>(vec3(0.7, 0.6, 0.5));
+	spheres->add(vec3(4, 1, 0), 1.f, material3);
+	spheres->build();
+	world.add(spheres);
 
 	return world;
 }
 
-hittable_list twoSphere()
+// bakeResolution > 1 bakes the noise over the sphere, the plane fades to exact noise at its edge
+hittable_list twoSphere(Arena& arena, int bakeResolution)
 {
-	auto noiseTexture = make_shared<NoiseTexture>(2);
-	auto noiseMat = make_shared<lambertian>(noiseTexture);
+	auto noiseTexture = arena.make<NoiseTexture>(2);
+	auto noiseMat = arena.make<lambertian>(noiseTexture);
+	auto ball = arena.make<sphere>(vec3(0, 0, 0), 5.0, noiseMat);
+	aabb ballBox;
+	if (bakeResolution > 1 && ball->boundingBox(0.f, 1.f, ballBox))
+	{
+		const NoiseVolume::Stats& stats = noiseTexture->bake(ballBox, bakeResolution).stats();
+		cout << "baked noise " << stats.dims[0] << "x" << stats.dims[1] << "x" << stats.dims[2] << ", " << stats.bytes / (1024. * 1024.)
+			<< "MB, turbulence error rms " << stats.rmsError << " max " << stats.maxError << "\n";
+	}
 	hittable_list world;
-	world.add(make_shared<sphere>(vec3(0, 0, 0), 5.0, noiseMat));
-	world.add(make_shared<sphere>(vec3(0, -1000, 0), 995.0, noiseMat));
+	world.add(ball);
+	world.add(arena.make<Plane>(vec3(0, -5, 0), vec3(0, 1, 0), noiseMat));
 	return world;
 }
 
-hittable_list planet()
+hittable_list planet(Arena& arena, TextureRegistry& textures)
 {
-	auto planetTexture = make_shared<ImageTexture>("res/textures/Gaseous4.png");
-	auto planetTexture2 = make_shared<ImageTexture>("res/textures/moonmap4k.jpg");
-	auto planetMat = make_shared<lambertian>(planetTexture);
-	auto planetMat2 = make_shared<lambertian>(planetTexture2);
+	auto planetTexture = textures.image("res/textures/Gaseous4.png");
+	auto planetTexture2 = textures.image("res/textures/moonmap4k.jpg");
+	auto planetMat = arena.make<lambertian>(planetTexture);
+	auto planetMat2 = arena.make<lambertian>(planetTexture2);
 	hittable_list world;
-	world.add(make_shared<sphere>(vec3(0, 0, 0), 5.0, planetMat));
-	world.add(make_shared<sphere>(vec3(0, -30, 0), 25, planetMat2));
+	world.add(arena.make<sphere>(vec3(0, 0, 0), 5.0, planetMat));
+	world.add(arena.make<sphere>(vec3(0, -30, 0), 25, planetMat2));
 	return world;
 }
 
-hittable_list CornellBox()
+hittable_list CornellBox(Arena& arena)
 {
 	hittable_list objects;
 
-	auto red = make_shared<lambertian>(vec3(.65, .05, .05));
-	auto white = make_shared<lambertian>(vec3(.73, .73, .73));
-	auto green = make_shared<lambertian>(vec3(.12, .45, .15));
-	auto light = make_shared<DiffuseLight>(vec3(15, 15, 15));
+	auto red = arena.make<lambertian>(vec3(.65, .05, .05));
+	auto white = arena.make<lambertian>(vec3(.73, .73, .73));
+	auto green = arena.make<lambertian>(vec3(.12, .45, .15));
+	auto light = arena.make<DiffuseLight>(vec3(15, 15, 15));
 
-	objects.add(make_shared<YZRect>(0, 555, 0, 555, 555, green));
-	objects.add(make_shared<YZRect>(0, 555, 0, 555, 0, red));
-	objects.add(make_shared<XZRect>(213, 343, 227, 332, 554, light));
-	objects.add(make_shared<XZRect>(0, 555, 0, 555, 0, white));
-	objects.add(make_shared<XZRect>(0, 555, 0, 555, 555, white));
-	objects.add(make_shared<XYRect>(0, 555, 0, 555, 555, white));
+	objects.add(arena.make<YZRect>(0, 555, 0, 555, 555, green));
+	objects.add(arena.make<YZRect>(0, 555, 0, 555, 0, red));
+	objects.add(arena.make<XZRect>(213, 343, 227, 332, 554, light));
+	objects.add(arena.make<XZRect>(0, 555, 0, 555, 0, white));
+	objects.add(arena.make<XZRect>(0, 555, 0, 555, 555, white));
+	objects.add(arena.make<XYRect>(0, 555, 0, 555, 555, white));
 
 
-	shared_ptr<hittable> box1 = make_shared<Box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-	box1 = make_shared<RotateY>(box1, 15);
-	box1 = make_shared<Translate>(box1, vec3(265, 0, 295));
-	box1 = make_shared<ConstantMedium>(box1, .01f, vec3(1.f, 1.f, 1.f));
+	shared_ptr<hittable> box1 = arena.make<Box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
+	box1 = arena.make<RotateY>(box1, 15);
+	box1 = arena.make<Translate>(box1, vec3(265, 0, 295));
+	box1 = arena.make<ConstantMedium>(box1, .01f, vec3(1.f, 1.f, 1.f));
 	objects.add(box1);
-	shared_ptr<hittable> box2 = make_shared<Box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
-	box2 = make_shared<RotateY>(box2, -18);
-	box2 = make_shared<Translate>(box2, vec3(130, 0, 65));
-	box2 = make_shared<ConstantMedium>(box2, .01f, vec3(0.f, 0.f, 0.f));
+	shared_ptr<hittable> box2 = arena.make<Box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
+	box2 = arena.make<RotateY>(box2, -18);
+	box2 = arena.make<Translate>(box2, vec3(130, 0, 65));
+	box2 = arena.make<ConstantMedium>(box2, .01f, vec3(0.f, 0.f, 0.f));
 	objects.add(box2);
 
 	return objects;
 }
 
-hittable_list lightScene()
+hittable_list lightScene(Arena& arena, TextureRegistry& textures)
 {
-	auto lightTexture1 = make_shared<ImageTexture>("res/textures/Gaseous1.png");
-	auto lightTexture2 = make_shared<ImageTexture>("res/textures/Gaseous2.png");
-	auto lightTexture3 = make_shared<ImageTexture>("res/textures/Gaseous3.png");
-	auto lightTexture4 = make_shared<ImageTexture>("res/textures/Gaseous4.png");
-	auto checker_tex = make_shared<checker_texture>(vec3(0.2, 0.3, 0.1), vec3(0.9, 0.9, 0.9));
-	auto lightMat1 = make_shared<DiffuseLight>(lightTexture1);
-	auto lightMat2 = make_shared<DiffuseLight>(lightTexture2);
-	auto lightMat3 = make_shared<DiffuseLight>(lightTexture3);
-	auto lightMat4 = make_shared<DiffuseLight>(lightTexture4);
-	auto difflight = make_shared<DiffuseLight>(vec3(4, 4, 4));
-	auto groundMat = make_shared<lambertian>(checker_tex);
+	auto lightTexture1 = textures.image("res/textures/Gaseous1.png");
+	auto lightTexture2 = textures.image("res/textures/Gaseous2.png");
+	auto lightTexture3 = textures.image("res/textures/Gaseous3.png");
+	auto lightTexture4 = textures.image("res/textures/Gaseous4.png");
+	auto checker_tex = arena.make<checker_texture>(vec3(0.2, 0.3, 0.1), vec3(0.9, 0.9, 0.9));
+	auto lightMat1 = arena.make<DiffuseLight>(lightTexture1);
+	auto lightMat2 = arena.make<DiffuseLight>(lightTexture2);
+	auto lightMat3 = arena.make<DiffuseLight>(lightTexture3);
+	auto lightMat4 = arena.make<DiffuseLight>(lightTexture4);
+	auto difflight = arena.make<DiffuseLight>(vec3(4, 4, 4));
+	auto groundMat = arena.make<lambertian>(checker_tex);
 	hittable_list world;
-	world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, groundMat));
+	world.add(arena.make<Plane>(vec3(0, 0, 0), vec3(0, 1, 0), groundMat));
+	auto spheres = arena.make<SphereSet>();
 
 	for (int a = -11; a < 11; a++) {
 		for (int b = -11; b < 11; b++) {
@@ -174,47 +198,128 @@ hittable_list lightScene()
 				shared_ptr<material> sphere_material;
 				if (choose_mat < 0.3)
 				{
-					world.add(make_shared<sphere>(center, 0.2, difflight));
+					spheres->add(center, 0.2f, difflight);
 				}
 				else if (choose_mat < 0.4)
 				{
-					world.add(make_shared<sphere>(center, 0.2, difflight));
+					spheres->add(center, 0.2f, difflight);
 				}
 				else if (choose_mat < 0.8) {
 					auto albedo = vec3(rtnextweek::random_double(0.5, 1.0), rtnextweek::random_double(0.5, 1.0), rtnextweek::random_double(0.5, 1.0));
 					auto fuzz = rtnextweek::random_double(0, 0.5);
-					sphere_material = make_shared<FuzzyMetal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = arena.make<FuzzyMetal>(albedo, fuzz);
+					spheres->add(center, 0.2f, sphere_material);
 				}
 				else {
-					sphere_material = make_shared<dielectric>(1.5);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = arena.make<dielectric>(1.5);
+					spheres->add(center, 0.2f, sphere_material);
 				}
 			}
 		}
 	}
 
-	auto material1 = make_shared<metal>(vec3(0.7, 0.6, 0.5));
-	world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
+	auto material1 = arena.make<metal>(vec3(0.7, 0.6, 0.5));
+	spheres->add(vec3(0, 1, 0), 1.f, material1);
 	
-	world.add(make_shared<sphere>(vec3(-4, 1, 0), 1.0, material1));
+	spheres->add(vec3(-4, 1, 0), 1.f, material1);
+
+	auto material3 = arena.make<metal>(vec3(0.7, 0.6, 0.5));
+	spheres->add(vec3(4, 1, 0), 1.f, material3);
+	spheres->build();
+	world.add(spheres);
+	return world;
+}
+
+// maps the .rtmesh at path. The first run converts the OBJ of the same name next to it, as
+// tools/obj2mesh would, and keeps the .rtmesh for later runs. nullptr when there is neither.
+shared_ptr<TriangleMesh> loadMesh(const char* path, shared_ptr<material> mat)
+{
+	std::error_code error;
+	if (!std::filesystem::exists(path, error))
+	{
+		const std::string obj = std::filesystem::path(path).replace_extension(".obj").string();
+		MeshData data;
+		if (!std::filesystem::exists(obj, error))
+		{
+			cerr << "WARNING: Neither '" << path << "' nor '" << obj << "' exists, the scene has no mesh.\n";
+			return nullptr;
+		}
+		if (!objloader::load(obj.c_str(), data)) return nullptr;
+		// a mesh that can't be cached is still rendered from the parsed data
+		if (!meshfile::write(path, data)) return make_shared<TriangleMesh>(std::move(data), mat);
+	}
+	return meshfile::load(path, mat);
+}
+
+hittable_list meshScene(Arena& arena, const char* path)
+{
+	auto checker_tex = arena.make<checker_texture>(vec3(0.2, 0.3, 0.1), vec3(0.9, 0.9, 0.9));
+	auto groundMat = arena.make<lambertian>(checker_tex);
+	auto meshMat = arena.make<lambertian>(vec3(.73, .73, .73));
+	auto light = arena.make<DiffuseLight>(vec3(4, 4, 4));
+	hittable_list world;
+	world.add(arena.make<Plane>(vec3(0, 0, 0), vec3(0, 1, 0), groundMat));
+	world.add(arena.make<sphere>(vec3(0, 10, 0), 3.0, light));
+
+	// .rtmesh files come from tools/obj2mesh, or loadMesh on first use, and are mapped, not parsed
+	auto start = std::chrono::steady_clock::now();
+	auto mesh = loadMesh(path, meshMat);
+	if (mesh)
+	{
+		world.add(mesh);
+		cout << "loaded " << mesh->triangleCount() << " triangles from " << path << " in "
+			<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms\n";
+	}
+	return world;
+}
 
-	auto material3 = make_shared<metal>(vec3(0.7, 0.6, 0.5));
-	world.add(make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+hittable_list instanceScene(Arena& arena, size_t count)
+{
+	auto groundMat = arena.make<lambertian>(vec3(0.5, 0.5, 0.5));
+	hittable_list world;
+	world.add(arena.make<Plane>(vec3(0, 0, 0), vec3(0, 1, 0), groundMat));
+
+	auto start = std::chrono::steady_clock::now();
+	auto instances = instanceStressSet(arena, count, loadMesh("res/meshes/model.rtmesh", groundMat));
+	world.add(instances);
+	cout << "built " << instances->size() << " instances in "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s, "
+		<< static_cast<double>(instances->memoryUsage()) / instances->size() << " bytes per instance\n";
 	return world;
 }
 
-int main()
+int main(int argc, char** argv)
 {
 	Window win(window_width, window_height, APP_NAME);
+	TextureCache::global().setBudget(static_cast<uint64_t>(texture_cache_mb) * 1024 * 1024);
 	Shader shader("res/shaders/base.vs", "res/shaders/base.fs");
 	FullScreenQuad screenBuffer;
 	bool needUpdate = true;
 	shared_ptr<camera> cam;
-	shared_ptr<BVHnode> world;
+	// scene objects and materials live until main returns, world must not outlive them
+	Arena sceneArena;
+	// images of the built-in scenes decode while their BVH builds
+	TextureRegistry textures(sceneArena);
+	shared_ptr<hittable> world;
 	vec3 background(0.f, 0.f, 0.f);
-	
-	switch (4)
+	// a scene file given on the command line replaces the built-in scenes
+	scenefile::Scene sceneFromFile;
+	// usage: RayTracingTheNextWeek [scene.json] [--bake-noise resolution]
+	const char* scenePath = nullptr;
+	int noiseBakeResolution = 0;	// 0 computes noise textures at every hit
+	for (int i = 1; i < argc; i++)
+	{
+		if (string(argv[i]) == "--bake-noise" && i + 1 < argc) noiseBakeResolution = atoi(argv[++i]);
+		else scenePath = argv[i];
+	}
+	const bool fromFile = scenePath && scenefile::load(scenePath, sceneArena, aspect_ratio, sceneFromFile);
+	if (fromFile)
+	{
+		world = sceneArena.make<CompiledScene>(sceneFromFile.world, 0.f, 1.f);
+		cam = sceneFromFile.cam;
+		background = sceneFromFile.background;
+	}
+	else switch (4)
 	{
 		glm::vec3 eye;
 		glm::vec3 center;
@@ -225,7 +330,7 @@ int main()
 		center = vec3(0, 0, 0);
 		up = vec3(0.f, 1.f, 0.f);
 		background = vec3(0.70, 0.80, 1.00);
-		world = make_shared<BVHnode>(random_scene(), 0.f, 1.f);
+		world = sceneArena.make<CompiledScene>(random_scene(sceneArena), 0.f, 1.f);
 		cam = make_shared<blurcamera>(eye, center, up, 1, 2, 2 * aspect_ratio, 0.1, 0.f, 1.f);
 		break;
 	case 1:
@@ -233,7 +338,7 @@ int main()
 		center = vec3(0, 0, 0);
 		up = vec3(0.f, 1.f, 0.f);
 		background = vec3(0.70, 0.80, 1.00);
-		world = make_shared<BVHnode>(twoSphere(), 0.f, 1.f);
+		world = sceneArena.make<CompiledScene>(twoSphere(sceneArena, noiseBakeResolution), 0.f, 1.f);
 		cam = make_shared<camera>(eye, center, up, 1, 2, 2 * aspect_ratio, 0.f, 1.f);
 		break;
 	case 2:
@@ -241,7 +346,7 @@ int main()
 		center = vec3(0, 0, 0);
 		up = vec3(0.f, 1.f, 0.f);
 		background = vec3(0.70, 0.80, 1.00);
-		world = make_shared<BVHnode>(planet(), 0.f, 1.f);
+		world = sceneArena.make<CompiledScene>(planet(sceneArena, textures), 0.f, 1.f);
 		cam = make_shared<camera>(eye, center, up, 10, 2, 2 * aspect_ratio, 0.f, 1.f);
 		break;
 	case 3:
@@ -249,7 +354,7 @@ int main()
 		center = vec3(0, 0, 0);
 		up = vec3(0.f, 1.f, 0.f);
 		background = vec3(0.03, 0.02, 0.1);
-		world = make_shared<BVHnode>(lightScene(), 0.f, 1.f);
+		world = sceneArena.make<CompiledScene>(lightScene(sceneArena, textures), 0.f, 1.f);
 		cam = make_shared<camera>(eye, center, up, 8, 2, 2 * aspect_ratio, 0.f, 1.f);
 		break;
 	case 4:
@@ -257,9 +362,25 @@ int main()
 		center = vec3(278, 278, 0);
 		up = vec3(0.f, 1.f, 0.f);
 		background = vec3(0, 0, 0);
-		world = make_shared<BVHnode>(CornellBox(), 0.f, 1.f);
+		world = sceneArena.make<CompiledScene>(CornellBox(sceneArena), 0.f, 1.f);
 		cam = make_shared<camera>(eye, center, up, 799, 555, 555 * aspect_ratio, 0.f, 1.f);
 		break;
+	case 5:
+		eye = vec3(13, 4, 7);
+		center = vec3(0, 1, 0);
+		up = vec3(0.f, 1.f, 0.f);
+		background = vec3(0.70, 0.80, 1.00);
+		world = sceneArena.make<CompiledScene>(meshScene(sceneArena, "res/meshes/model.rtmesh"), 0.f, 1.f);
+		cam = make_shared<camera>(eye, center, up, 8, 2, 2 * aspect_ratio, 0.f, 1.f);
+		break;
+	case 6:
+		eye = vec3(-1600, 300, -1600);
+		center = vec3(0, 0, 0);
+		up = vec3(0.f, 1.f, 0.f);
+		background = vec3(0.70, 0.80, 1.00);
+		world = sceneArena.make<CompiledScene>(instanceScene(sceneArena, 1000000), 0.f, 1.f);
+		cam = make_shared<camera>(eye, center, up, 2, 2, 2 * aspect_ratio, 0.f, 1.f);
+		break;
 	}
 	
 	GLuint texture = createTexture();
@@ -277,19 +398,9 @@ int main()
 		p[index++] = b;
 	};
 
-	std::function<glm::vec3(const ray&, const vec3& background,const hittable&, int)> ray_color = [&](const ray& r, const vec3& background, const hittable& list, int depth)->glm::vec3
-	{
-		hit_record record;
-		if (depth <= 0) return vec3(0.f);
-		if (!list.hit(r, .001, infinity, record)) return background;
-		ray scattered;
-		vec3 attenuation;
-		vec3 emitted = record.pMat->emitted(record.u, record.v, record.p);
-
-		if (!record.pMat->scatter(r, record, attenuation, scattered)) return emitted;
-		vec3 color = emitted + attenuation * ray_color(scattered, background, list, depth - 1);
-		return color;
-	};
+	textures.wait();
+	Integrator integrator(*world, background, ray_depth);
+	integrator.setPixelSpread(cam->pixelSpread(window_height) / std::sqrt(static_cast<float>(samples)));
 
 	win.SetRenderOperation([&]()
 	{
@@ -306,7 +417,7 @@ int main()
 						glm::vec3 color(0.f);
 						for (int s = 0; s < samples; ++s)
 						{
-							color += ray_color(cam->getRayFromScreenPos(u + rtnextweek::random_double() / (window_height - 1), v + rtnextweek::random_double() / (window_width - 1)), background, *world, ray_depth);
+							color += integrator.radiance(cam->getRayFromScreenPos(u + rtnextweek::random_float() / (window_height - 1), v + rtnextweek::random_float() / (window_width - 1)));
 						}
 						color /= samples;
 						vec3 mapped = vec3(1.0) - exp(-color * exposure);
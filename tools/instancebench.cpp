@@ -0,0 +1,57 @@
+// instancebench.cpp : Builds the instancing stress scene at several sizes and reports
+// build time, memory per instance and ray throughput, without opening a window.
+//
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "camera.h"
+#include "StressScene.h"
+#include "CompiledScene.h"
+using namespace std;
+
+int main(int argc, char** argv)
+{
+	vector<size_t> counts;
+	for (int i = 1; i < argc; i++) counts.push_back(strtoull(argv[i], nullptr, 10));
+	if (counts.empty()) counts = { 10000, 100000, 1000000 };
+	const int rays = 1000000;
+
+	for (size_t count : counts)
+	{
+		Arena arena;
+		auto start = chrono::steady_clock::now();
+		auto set = instanceStressSet(arena, count);
+		hittable_list list;
+		list.add(arena.make<Plane>(vec3(0, 0, 0), vec3(0, 1, 0), arena.make<lambertian>(vec3(.5, .5, .5))));
+		list.add(set);
+		CompiledScene world(list, 0.f, 1.f);
+		const double buildTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		// rays from above the field towards random points on it, so every size sees the same mix
+		aabb box;
+		set->boundingBox(0, 1, box);
+		// one draw per statement, argument evaluation order would make the rays compiler dependent
+		rtnextweek::Pcg32 rng(7);
+		auto uniform = [&](float min, float max) { return min + (max - min) * rng.uniform(); };
+		size_t hits = 0;
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < rays; i++)
+		{
+			const float targetX = uniform(box.min().x, box.max().x);
+			const float targetZ = uniform(box.min().z, box.max().z);
+			const float offsetX = uniform(-20.f, 20.f);
+			const float offsetZ = uniform(-20.f, 20.f);
+			const vec3 target(targetX, 0.f, targetZ);
+			const vec3 origin = target + vec3(offsetX, 30.f, offsetZ);
+			hit_record rec;
+			hits += world.hit(ray(origin, target - origin), real(0.001), std::numeric_limits<real>::infinity(), rec);
+		}
+		const double traceTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		cout << count << " instances: built in " << buildTime << "s, "
+			<< static_cast<double>(set->memoryUsage()) / set->size() << " bytes per instance, "
+			<< rays / traceTime / 1e6 << " Mrays/s (" << hits << " hits)\n";
+	}
+	return 0;
+}
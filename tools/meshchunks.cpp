@@ -0,0 +1,187 @@
+// meshchunks.cpp : Splits a mesh into spatially coherent chunks, each written as its own
+// .rtmesh with a prebuilt BVH, plus a manifest listing their bounds for ChunkedGeometry.
+// The bench command traces the same rays one at a time and queued per chunk, and reports
+// how often chunks had to be paged in under a residency budget.
+//
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include "camera.h"
+#include "ObjLoader.h"
+#include "MeshFile.h"
+#include "ChunkedGeometry.h"
+using namespace std;
+
+static bool readMesh(const char* path, MeshData& mesh)
+{
+	const string file(path);
+	if (file.size() < 7 || file.compare(file.size() - 7, 7, ".rtmesh") != 0) return objloader::load(path, mesh);
+	// every index is copied and used below, so check them all
+	auto mapped = meshfile::load(path, nullptr, true);
+	if (!mapped) return false;
+	const MeshView& v = mapped->view();
+	mesh.positions.assign(v.positions, v.positions + v.vertexCount);
+	if (v.normals) mesh.normals.assign(v.normals, v.normals + v.vertexCount);
+	if (v.uvs) mesh.uvs.assign(v.uvs, v.uvs + v.vertexCount);
+	mesh.indices.assign(v.indices, v.indices + size_t(v.triangleCount) * 3);
+	return true;
+}
+
+// median splits along the widest centroid axis until every chunk is small enough
+static void partition(const MeshData& mesh, const vector<glm::vec3>& centroids, vector<uint32_t>::iterator begin,
+	vector<uint32_t>::iterator end, size_t maxTriangles, vector<vector<uint32_t>>& chunks)
+{
+	const size_t n = end - begin;
+	if (n <= maxTriangles)
+	{
+		chunks.emplace_back(begin, end);
+		return;
+	}
+	glm::vec3 lo(numeric_limits<float>::max()), hi(-numeric_limits<float>::max());
+	for (auto it = begin; it != end; ++it)
+	{
+		lo = glm::min(lo, centroids[*it]);
+		hi = glm::max(hi, centroids[*it]);
+	}
+	const glm::vec3 extent = hi - lo;
+	const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	auto mid = begin + n / 2;
+	nth_element(begin, mid, end, [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+	partition(mesh, centroids, begin, mid, maxTriangles, chunks);
+	partition(mesh, centroids, mid, end, maxTriangles, chunks);
+}
+
+static int split(const char* input, const string& manifestPath, size_t maxTriangles)
+{
+	auto start = chrono::steady_clock::now();
+	MeshData mesh;
+	if (!readMesh(input, mesh)) return 1;
+	const size_t triangles = mesh.indices.size() / 3;
+	vector<glm::vec3> centroids(triangles);
+	for (size_t t = 0; t < triangles; t++)
+		centroids[t] = (mesh.positions[mesh.indices[3 * t]] + mesh.positions[mesh.indices[3 * t + 1]]
+			+ mesh.positions[mesh.indices[3 * t + 2]]) / 3.f;
+	vector<uint32_t> order(triangles);
+	iota(order.begin(), order.end(), 0u);
+	vector<vector<uint32_t>> chunks;
+	partition(mesh, centroids, order.begin(), order.end(), maxTriangles, chunks);
+
+	const size_t slash = manifestPath.find_last_of("/\\");
+	const string directory = slash == string::npos ? string() : manifestPath.substr(0, slash + 1);
+	string stem = manifestPath.substr(directory.size());
+	stem = stem.substr(0, stem.find('.'));
+	ofstream manifest(manifestPath, ios::trunc);
+	if (!manifest)
+	{
+		cerr << "ERROR: Could not open '" << manifestPath << "' for writing.\n";
+		return 1;
+	}
+	manifest << "{\n\t\"chunks\": [\n";
+	const bool hasNormals = mesh.normals.size() == mesh.positions.size();
+	const bool hasUvs = mesh.uvs.size() == mesh.positions.size();
+	for (size_t c = 0; c < chunks.size(); c++)
+	{
+		// chunks get their own compact vertex arrays
+		MeshData part;
+		unordered_map<uint32_t, uint32_t> remap;
+		for (uint32_t t : chunks[c])
+			for (int k = 0; k < 3; k++)
+			{
+				const uint32_t v = mesh.indices[3 * t + k];
+				auto inserted = remap.emplace(v, static_cast<uint32_t>(part.positions.size()));
+				if (inserted.second)
+				{
+					part.positions.push_back(mesh.positions[v]);
+					if (hasNormals) part.normals.push_back(mesh.normals[v]);
+					if (hasUvs) part.uvs.push_back(mesh.uvs[v]);
+				}
+				part.indices.push_back(inserted.first->second);
+			}
+		glm::vec3 lo(numeric_limits<float>::max()), hi(-numeric_limits<float>::max());
+		for (const glm::vec3& p : part.positions)
+		{
+			lo = glm::min(lo, p);
+			hi = glm::max(hi, p);
+		}
+
+		const string name = stem + "_" + to_string(c) + ".rtmesh";
+		if (!meshfile::write((directory + name).c_str(), part)) return 1;
+		ifstream written(directory + name, ios::binary | ios::ate);
+		manifest << "\t\t{ \"file\": \"" << name << "\", \"bytes\": " << static_cast<uint64_t>(written.tellg())
+			<< ", \"triangles\": " << chunks[c].size()
+			<< ", \"min\": [" << lo.x << ", " << lo.y << ", " << lo.z << "], \"max\": [" << hi.x << ", " << hi.y << ", " << hi.z << "] }"
+			<< (c + 1 < chunks.size() ? ",\n" : "\n");
+	}
+	manifest << "\t]\n}\n";
+	cout << "wrote " << chunks.size() << " chunks of up to " << maxTriangles << " triangles from " << triangles << " in "
+		<< chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s\n";
+	return 0;
+}
+
+static int bench(const char* manifest, uint64_t budget, size_t rayCount)
+{
+	// rays between random points on a sphere around the geometry, in no particular order
+	shared_ptr<ChunkedGeometry> geometry = ChunkedGeometry::load(manifest, nullptr, budget);
+	if (!geometry) return 1;
+	aabb box;
+	geometry->boundingBox(0, 1, box);
+	const glm::vec3 center = .5f * (box.min() + box.max());
+	const float radius = glm::length(box.max() - box.min());
+	mt19937 rng(3);
+	normal_distribution<float> gauss;
+	auto onSphere = [&]()
+	{
+		glm::vec3 d;
+		for (int i = 0; i < 3; i++) d[i] = gauss(rng);
+		return center + radius * glm::normalize(d);
+	};
+	vector<ray> rays;
+	for (size_t i = 0; i < rayCount; i++)
+	{
+		const glm::vec3 from = onSphere();
+		const glm::vec3 to = onSphere();
+		rays.emplace_back(from, to - from, 0.f);
+	}
+	vector<hit_record> recs(rayCount);
+	unique_ptr<bool[]> hits(new bool[rayCount]);
+	const real tMin = real(0.001), tMax = numeric_limits<real>::infinity();
+
+	auto start = chrono::steady_clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < rayCount; i++) found += geometry->hit(rays[i], tMin, tMax, recs[i]);
+	const auto single = geometry->stats();
+	cout << "one at a time: " << found << " hits, " << single.pageIns << " page-ins, " << single.evictions << " evictions, "
+		<< chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s\n";
+
+	geometry = ChunkedGeometry::load(manifest, nullptr, budget);
+	start = chrono::steady_clock::now();
+	const size_t batchSize = 1 << 16;
+	found = 0;
+	for (size_t first = 0; first < rayCount; first += batchSize)
+	{
+		const size_t n = std::min(batchSize, rayCount - first);
+		geometry->hitBatch(rays.data() + first, n, tMin, tMax, recs.data() + first, hits.get() + first);
+		found += count(hits.get() + first, hits.get() + first + n, true);
+	}
+	const auto queued = geometry->stats();
+	cout << "queued per chunk: " << found << " hits, " << queued.pageIns << " page-ins, " << queued.evictions << " evictions, "
+		<< chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s\n";
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	const string command = argc > 1 ? argv[1] : "";
+	if (command == "split" && (argc == 4 || argc == 5))
+		return split(argv[2], argv[3], argc == 5 ? strtoull(argv[4], nullptr, 10) : 65536);
+	if (command == "bench" && (argc == 4 || argc == 5))
+		return bench(argv[2], strtoull(argv[3], nullptr, 10) << 20, argc == 5 ? strtoull(argv[4], nullptr, 10) : 1000000);
+	cerr << "usage: meshchunks split <input.obj|input.rtmesh> <output.json> [max triangles per chunk]\n"
+		<< "       meshchunks bench <manifest.json> <budget MB> [rays]\n";
+	return 1;
+}
@@ -0,0 +1,28 @@
+// obj2mesh.cpp : Converts a Wavefront OBJ file to the binary .rtmesh format
+// with its BVH prebuilt, so the renderer can map it without parsing.
+//
+#include <chrono>
+#include <iostream>
+#include "ObjLoader.h"
+#include "MeshFile.h"
+using namespace std;
+
+int main(int argc, char** argv)
+{
+	if (argc != 3)
+	{
+		cerr << "usage: obj2mesh <input.obj> <output.rtmesh>\n";
+		return 1;
+	}
+
+	auto start = chrono::steady_clock::now();
+	MeshData mesh;
+	if (!objloader::load(argv[1], mesh)) return 1;
+	auto parsed = chrono::steady_clock::now();
+	cout << argv[1] << ": " << mesh.positions.size() << " vertices, " << mesh.indices.size() / 3 << " triangles, parsed in "
+		<< chrono::duration<double>(parsed - start).count() << "s\n";
+
+	if (!meshfile::write(argv[2], mesh)) return 1;
+	cout << "wrote " << argv[2] << " in " << chrono::duration<double>(chrono::steady_clock::now() - parsed).count() << "s\n";
+	return 0;
+}